@@ -0,0 +1,95 @@
+//   Copyright 2023 qwrpc - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Counts heap allocations per submitted task for the different ways to submit one.
+#include "qwrpc/qwrpc.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+
+namespace qwrpc_bench
+{
+  std::atomic<std::size_t> allocations{0};
+}
+
+void *operator new(std::size_t size)
+{
+  qwrpc_bench::allocations.fetch_add(1, std::memory_order_relaxed);
+  if (auto p = std::malloc(size == 0 ? 1 : size)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+namespace qwrpc_bench
+{
+  constexpr int tasks = 100000;
+  
+  // Submits `tasks` tasks with `submit` and returns allocations and nanoseconds per task.
+  template<typename Submit>
+  std::pair<double, double> measure(Submit &&submit)
+  {
+    std::atomic<int> done{0};
+    // Warm up, so that the queues have grown to their final size.
+    for (int i = 0; i < tasks; ++i) submit(done);
+    while (done.load(std::memory_order_acquire) < tasks) std::this_thread::yield();
+    done = 0;
+    auto before = allocations.load();
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < tasks; ++i) submit(done);
+    while (done.load(std::memory_order_acquire) < tasks) std::this_thread::yield();
+    auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+    return {static_cast<double>(allocations.load() - before) / tasks, ns / tasks};
+  }
+  
+  void report(const char *name, std::pair<double, double> r)
+  {
+    std::printf("%-36s %12.2f %12.1f\n", name, r.first, r.second);
+  }
+}
+
+int main()
+{
+  using qwrpc::connector::Thpool;
+  using qwrpc::executor::Executor;
+  constexpr std::size_t threads = 4;
+  std::printf("%-36s %12s %12s\n", "", "allocs/task", "ns/task");
+  {
+    Thpool pool(threads);
+    qwrpc_bench::report("Thpool::add_task", qwrpc_bench::measure(
+        [&pool](std::atomic<int> &done) { pool.add_task([&done] { done.fetch_add(1); }); }));
+  }
+  {
+    Executor pool(threads);
+    qwrpc_bench::report("Executor::add_task", qwrpc_bench::measure(
+        [&pool](std::atomic<int> &done) { pool.add_task([&done] { done.fetch_add(1); }); }));
+  }
+  {
+    Executor pool(threads);
+    qwrpc_bench::report("Executor::post", qwrpc_bench::measure(
+        [&pool](std::atomic<int> &done) { pool.post([&done] { done.fetch_add(1); }); }));
+  }
+  {
+    Executor pool(threads);
+    std::array<char, 2 * qwrpc::executor::Task::inline_size> big{};
+    qwrpc_bench::report("Executor::post, too big to be inline", qwrpc_bench::measure(
+        [&pool, &big](std::atomic<int> &done) { pool.post([&done, big] { done.fetch_add(1 + big[0]); }); }));
+  }
+}
@@ -0,0 +1,103 @@
+//   Copyright 2023 qwrpc - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Ratio and throughput of the frame compression on typical payloads, and the link speed below which
+// compressing a message gets it across faster than sending it as is.
+#include "qwrpc/qwrpc.hpp"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace qwrpc_bench
+{
+  // Runs f until at least 0.2s have passed, returns seconds per run.
+  template<typename F>
+  double seconds_per_run(F &&f)
+  {
+    std::size_t runs = 0;
+    auto begin = std::chrono::steady_clock::now();
+    double elapsed;
+    do
+    {
+      f();
+      ++runs;
+      elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    } while (elapsed < 0.2);
+    return elapsed / runs;
+  }
+  
+  // A request envelope as RpcClient builds it.
+  template<typename... Args>
+  std::string envelope(Args &&... args)
+  {
+    czh::Node params
+        {
+            {"id",           std::string("method")},
+            {"expected_ret", std::string("int")},
+            {"args",         qwrpc::method::args_to_czh_array(std::forward<Args>(args)...)}
+        };
+    return qwrpc::utils::to_str(params);
+  }
+  
+  void run(const char *name, const std::string &payload)
+  {
+    std::string packed;
+    bool smaller = qwrpc::compress::compress(payload.data(), payload.size(), packed);
+    auto compress = seconds_per_run([&]
+                                    {
+                                      packed.clear();
+                                      qwrpc::compress::compress(payload.data(), payload.size(), packed);
+                                    });
+    double ratio = 1;
+    double decompress = 0;
+    if (smaller)
+    {
+      ratio = static_cast<double>(payload.size()) / packed.size();
+      std::string unpacked;
+      decompress = seconds_per_run([&]
+                                   {
+                                     qwrpc::compress::decompress(packed.data(), packed.size(), unpacked,
+                                                                 payload.size());
+                                   });
+    }
+    // payload / link > (compress + decompress) + packed / link
+    double break_even = smaller ? (payload.size() - packed.size()) / (compress + decompress) / (1 << 20) : 0;
+    auto mib_per_s = [&payload](double s) { return s == 0 ? 0 : payload.size() / s / (1 << 20); };
+    std::printf("%-28s %10zu %8.2f %16.0f %18.0f %20.0f\n", name, payload.size(), ratio,
+                mib_per_s(compress), mib_per_s(decompress), break_even);
+  }
+}
+
+int main()
+{
+  std::mt19937 rng(42);
+  std::vector<int> ints(100000);
+  for (auto &r: ints) r = static_cast<int>(rng() % 100000);
+  std::vector<std::string> words(20000);
+  const char *dict[] = {"alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta"};
+  for (auto &r: words) r = std::string(dict[rng() % 8]) + std::to_string(rng() % 1000);
+  std::vector<double> doubles(100000);
+  for (auto &r: doubles) r = std::uniform_real_distribution<double>(0, 1000)(rng);
+  std::string random(1 << 20, '\0');
+  for (auto &r: random) r = static_cast<char>(rng());
+  
+  std::printf("%-28s %10s %8s %16s %18s %20s\n", "", "bytes", "ratio", "compress(MiB/s)", "decompress(MiB/s)",
+              "faster below(MiB/s)");
+  qwrpc_bench::run("envelope, vector<int>", qwrpc_bench::envelope(ints));
+  qwrpc_bench::run("envelope, vector<string>", qwrpc_bench::envelope(words));
+  qwrpc_bench::run("serialize(vector<double>)", qwrpc::serialize(doubles));
+  qwrpc_bench::run("random bytes", random);
+}
@@ -0,0 +1,101 @@
+//   Copyright 2023 qwrpc - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// What formatting and parsing the envelope of one call costs on each side, in czh and in the binary form.
+// Every round trip is: the client formats the request, the server parses it and formats the response,
+// the client parses that.
+#include "qwrpc/qwrpc.hpp"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace qwrpc_bench
+{
+  // Runs f until at least 0.2s have passed, returns seconds per run.
+  template<typename F>
+  double seconds_per_run(F &&f)
+  {
+    std::size_t runs = 0;
+    auto begin = std::chrono::steady_clock::now();
+    double elapsed;
+    do
+    {
+      f();
+      ++runs;
+      elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    } while (elapsed < 0.2);
+    return elapsed / runs;
+  }
+  
+  czh::Node parse(const std::string &str)
+  {
+    czh::Czh parser(str, czh::InputMode::string);
+    return parser.parse();
+  }
+  
+  // The czh request as RpcServer reads it.
+  qwrpc::envelope::Request czh_request(const std::string &str)
+  {
+    auto node = parse(str);
+    qwrpc::envelope::Request req;
+    req.id = node["id"].get<std::string>();
+    req.expected_ret.hash = qwrpc::method::type_hash(node["expected_ret"].get<std::string>());
+    qwrpc::method::czh_to_param(node["args"].get<czh::value::Array>(), req.args);
+    return req;
+  }
+  
+  template<typename Ret, typename... Args>
+  void run(const char *name, const Ret &ret, Args &&... args)
+  {
+    qwrpc::envelope::Request request;
+    request.id = "method";
+    request.expected_ret = qwrpc::method::qwrpc_type<Ret>();
+    request.args = qwrpc::method::args_to_param(std::forward<Args>(args)...);
+    qwrpc::envelope::Response response;
+    response.ret.emplace_back(qwrpc::serialize(ret), qwrpc::method::qwrpc_type<Ret>());
+    
+    auto czh_req = qwrpc::envelope::to_czh(request);
+    auto czh_res = qwrpc::envelope::to_czh(response);
+    auto bin_req = qwrpc::envelope::encode(request);
+    auto bin_res = qwrpc::envelope::encode(response);
+    
+    double czh_format = seconds_per_run([&] { qwrpc::envelope::to_czh(request); })
+                        + seconds_per_run([&] { qwrpc::envelope::to_czh(response); });
+    double czh_parse = seconds_per_run([&] { czh_request(czh_req); })
+                       + seconds_per_run([&] { qwrpc::envelope::response_from_czh(parse(czh_res)); });
+    double bin_format = seconds_per_run([&] { qwrpc::envelope::encode(request); })
+                        + seconds_per_run([&] { qwrpc::envelope::encode(response); });
+    double bin_parse = seconds_per_run([&] { qwrpc::envelope::decode_request(bin_req); })
+                       + seconds_per_run([&] { qwrpc::envelope::decode_response(bin_res); });
+    
+    auto ns = [](double s) { return s * 1e9; };
+    std::printf("%-24s %10zu %10zu %14.0f %14.0f %14.0f %14.0f %8.1fx\n", name,
+                czh_req.size() + czh_res.size(), bin_req.size() + bin_res.size(),
+                ns(czh_format), ns(czh_parse), ns(bin_format), ns(bin_parse),
+                (czh_format + czh_parse) / (bin_format + bin_parse));
+  }
+}
+
+int main()
+{
+  std::vector<int> ints(100);
+  for (int i = 0; i < 100; ++i) ints[i] = i;
+  
+  std::printf("%-24s %10s %10s %14s %14s %14s %14s %9s\n", "", "czh bytes", "bin bytes",
+              "czh format(ns)", "czh parse(ns)", "bin format(ns)", "bin parse(ns)", "speedup");
+  qwrpc_bench::run("int(int, int)", 3, 1, 2);
+  qwrpc_bench::run("string(string)", std::string("hello, world"), std::string("hello"));
+  qwrpc_bench::run("int(vector<int>)", 4950, ints);
+}
@@ -0,0 +1,110 @@
+//   Copyright 2023 qwrpc - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Compares connector::Thpool with executor::Executor at 1 to 64 threads.
+// "spread": 4 outside threads submit small tasks, like the server loops do.
+// "fork": tasks submit more tasks from inside the pool.
+#include "qwrpc/qwrpc.hpp"
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+namespace qwrpc_bench
+{
+  constexpr int tasks = 200000;
+  constexpr int submitters = 4;
+  constexpr int fanout = 4;
+  
+  void spin_work()
+  {
+    volatile int x = 0;
+    for (int i = 0; i < 200; ++i) x = x + i;
+  }
+  
+  void wait_for(const std::atomic<int> &done, int n)
+  {
+    while (done.load(std::memory_order_acquire) < n) std::this_thread::yield();
+  }
+  
+  template<typename Pool>
+  double spread(std::size_t threads)
+  {
+    Pool pool(threads);
+    std::atomic<int> done{0};
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers;
+    for (int p = 0; p < submitters; ++p)
+    {
+      producers.emplace_back([&pool, &done]
+                             {
+                               for (int i = 0; i < tasks / submitters; ++i)
+                               {
+                                 pool.add_task([&done]
+                                               {
+                                                 spin_work();
+                                                 done.fetch_add(1, std::memory_order_release);
+                                               });
+                               }
+                             });
+    }
+    for (auto &r: producers) r.join();
+    wait_for(done, tasks);
+    return tasks / std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  }
+  
+  template<typename Pool>
+  void fork(Pool &pool, std::atomic<int> &done, int depth)
+  {
+    spin_work();
+    if (depth > 0)
+    {
+      for (int i = 0; i < fanout; ++i)
+      {
+        pool.add_task([&pool, &done, depth] { fork(pool, done, depth - 1); });
+      }
+    }
+    done.fetch_add(1, std::memory_order_release);
+  }
+  
+  template<typename Pool>
+  double fork(std::size_t threads)
+  {
+    // 1 + 4 + ... + 4^8 tasks
+    constexpr int depth = 8;
+    int total = 0;
+    for (int i = 0, n = 1; i <= depth; ++i, n *= fanout) total += n;
+    Pool pool(threads);
+    std::atomic<int> done{0};
+    auto begin = std::chrono::steady_clock::now();
+    pool.add_task([&pool, &done] { fork(pool, done, depth); });
+    wait_for(done, total);
+    return total / std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  }
+}
+
+int main()
+{
+  using qwrpc::connector::Thpool;
+  using qwrpc::executor::Executor;
+  std::printf("%8s %16s %16s %16s %16s\n", "threads", "Thpool spread/s", "Executor spread/s",
+              "Thpool fork/s", "Executor fork/s");
+  for (std::size_t threads: {1, 2, 4, 8, 16, 32, 64})
+  {
+    std::printf("%8zu %16.0f %16.0f %16.0f %16.0f\n", threads,
+                qwrpc_bench::spread<Thpool>(threads), qwrpc_bench::spread<Executor>(threads),
+                qwrpc_bench::fork<Thpool>(threads), qwrpc_bench::fork<Executor>(threads));
+    std::fflush(stdout);
+  }
+}
@@ -0,0 +1,98 @@
+//   Copyright 2023 qwrpc - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Throughput of serialize() and deserialize() on numeric arrays and on containers that go element by element.
+#include "qwrpc/qwrpc.hpp"
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <list>
+#include <random>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace qwrpc_bench
+{
+  struct Point
+  {
+    double x;
+    double y;
+    double z;
+  };
+}
+
+// Has no serialize() of its own, so its containers may be copied in one block.
+template<>
+struct qwrpc::serializer::is_bitwise_serializable<qwrpc_bench::Point> : public std::true_type {};
+
+namespace qwrpc_bench
+{
+  // Runs f until at least 0.2s have passed, returns seconds per run.
+  template<typename F>
+  double seconds_per_run(F &&f)
+  {
+    std::size_t runs = 0;
+    auto begin = std::chrono::steady_clock::now();
+    double elapsed;
+    do
+    {
+      f();
+      ++runs;
+      elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    } while (elapsed < 0.2);
+    return elapsed / runs;
+  }
+  
+  // `Out` is what the data is read back as, a span is read back as a std::vector.
+  template<typename Out, typename T>
+  void run(const char *name, const T &value)
+  {
+    auto str = qwrpc::serialize(value);
+    std::size_t sink = 0;
+    auto serialize = seconds_per_run([&] { sink += qwrpc::serialize(value).size(); });
+    auto deserialize = seconds_per_run([&] { sink += qwrpc::deserialize<Out>(str).size(); });
+    auto gb_per_s = [&str](double s) { return str.size() / s / 1e9; };
+    std::printf("%-28s %12zu %16.2f %18.2f %s\n", name, str.size(), gb_per_s(serialize), gb_per_s(deserialize),
+                sink == 0 ? "!" : "");
+  }
+}
+
+int main()
+{
+  std::mt19937 rng(42);
+  std::vector<double> doubles(1 << 20);
+  for (auto &r: doubles) r = std::uniform_real_distribution<double>(0, 1000)(rng);
+  std::vector<int> ints(1 << 20);
+  for (auto &r: ints) r = static_cast<int>(rng());
+  std::vector<qwrpc_bench::Point> points(1 << 18);
+  for (auto &r: points) r = {doubles[rng() % doubles.size()], doubles[rng() % doubles.size()], 0};
+  std::vector<std::array<float, 4>> vec4(1 << 18);
+  for (auto &r: vec4) r = {1, 2, 3, static_cast<float>(rng())};
+  std::vector<std::vector<int>> rows(1024, std::vector<int>(1024));
+  for (auto &r: rows) r = std::vector<int>(ints.begin(), ints.begin() + 1024);
+  std::list<int> list(ints.begin(), ints.begin() + (1 << 18));
+  std::vector<std::string> words(1 << 16);
+  for (auto &r: words) r = "word" + std::to_string(rng() % 100000);
+  
+  std::printf("%-28s %12s %16s %18s\n", "", "bytes", "serialize(GB/s)", "deserialize(GB/s)");
+  qwrpc_bench::run<std::vector<double>>("vector<double>", doubles);
+  qwrpc_bench::run<std::vector<double>>("span<const double>", std::span<const double>(doubles));
+  qwrpc_bench::run<std::vector<int>>("vector<int>", ints);
+  qwrpc_bench::run<std::vector<qwrpc_bench::Point>>("vector<Point>", points);
+  qwrpc_bench::run<std::vector<std::array<float, 4>>>("vector<array<float, 4>>", vec4);
+  qwrpc_bench::run<std::vector<std::vector<int>>>("vector<vector<int>>", rows);
+  qwrpc_bench::run<std::list<int>>("list<int>", list);
+  qwrpc_bench::run<std::vector<std::string>>("vector<string>", words);
+}
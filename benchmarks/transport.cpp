@@ -0,0 +1,112 @@
+//   Copyright 2023 qwrpc - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Compares loopback TCP with a Unix domain socket and shared memory for same-host calls.
+#include "qwrpc/qwrpc.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace qwrpc_bench
+{
+  std::unique_ptr<qwrpc::RpcClient> connect(const qwrpc::connector::Addr &addr,
+                                            const qwrpc::connector::ClientConfig &config)
+  {
+    // The server is started on another thread, wait for it.
+    for (int i = 0; i < 100; ++i)
+    {
+      try
+      {
+        return std::make_unique<qwrpc::RpcClient>(addr, config);
+      }
+      catch (qwrpc::error::Error &)
+      {
+        std::this_thread::sleep_for(50ms);
+      }
+    }
+    throw qwrpc::error::Error("Can not connect to the benchmark server.");
+  }
+  
+  template<typename F>
+  double seconds(F &&f)
+  {
+    auto begin = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  }
+  
+  void run(const char *name, const qwrpc::connector::Addr &addr, const qwrpc::connector::ClientConfig &config = {})
+  {
+    constexpr int calls = 20000;
+    constexpr int window = 128;
+    constexpr int payloads = 2000;
+    auto cli = connect(addr, config);
+    
+    auto sequential = seconds([&]
+                              {
+                                for (int i = 0; i < calls; ++i) cli->call<int>("plus", i, 1);
+                              });
+    auto pipelined = seconds([&]
+                             {
+                               std::vector<std::future<int>> rets;
+                               for (int i = 0; i < calls; i += window)
+                               {
+                                 for (int j = 0; j < window; ++j) rets.emplace_back(cli->async_call<int>("plus", i, j));
+                                 for (auto &r: rets) r.get();
+                                 rets.clear();
+                               }
+                             });
+    std::string payload(64 * 1024, 'x');
+    auto bulk = seconds([&]
+                        {
+                          for (int i = 0; i < payloads; ++i) cli->call<std::string>("echo", payload);
+                        });
+    std::printf("%-6s %12.2f %14.0f %14.1f\n", name,
+                sequential / calls * 1e6, calls / pipelined, 2.0 * payloads * payload.size() / bulk / (1 << 20));
+  }
+}
+
+int main()
+{
+  const int port = 8766;
+  const std::string path = "/tmp/qwrpc_bench.sock";
+  const std::string shm_path = "/tmp/qwrpc_bench_shm.sock";
+  for (auto addr: {qwrpc::connector::Addr{port}, qwrpc::connector::Addr::unix_socket(path)})
+  {
+    std::thread([addr, shm_path]
+                {
+                  qwrpc::connector::ServerConfig config;
+                  if (addr.family() == AF_INET) config.shm_path = shm_path;
+                  qwrpc::RpcServer svr(addr, config);
+                  svr.register_method("plus", std::plus<int>());
+                  svr.register_method("echo", [](std::string s) { return s; });
+                  svr.start();
+                }).detach();
+  }
+  std::printf("%-6s %12s %14s %14s\n", "", "rtt(us)", "pipelined/s", "echo(MiB/s)");
+  qwrpc_bench::run("tcp", {"127.0.0.1", port});
+  qwrpc_bench::run("unix", qwrpc::connector::Addr::unix_socket(path));
+#ifdef QWRPC_HAS_SHM
+  qwrpc::connector::ClientConfig shm_config;
+  shm_config.mode = qwrpc::connector::ClientMode::shared_memory;
+  qwrpc_bench::run("shm", qwrpc::connector::Addr::unix_socket(shm_path), shm_config);
+#endif
+  // The servers have no way to stop, leave without waiting for them.
+  std::fflush(stdout);
+  std::quick_exit(0);
+}
@@ -15,6 +15,11 @@
 #include "qwrpc/qwrpc.hpp"
 #include <iostream>
 #include <future>
+qwrpc::coro::Task<int> plus_twice(qwrpc::RpcClient &cli, int a)
+{
+  auto b = co_await cli.call_co<int>("plus", a, 1);
+  co_return co_await cli.call_co<int>("plus", b, 1);
+}
 int main()
 {
   qwrpc::RpcClient cli("127.0.0.1", 8765);
@@ -41,5 +46,24 @@ int main()
   std::cout << "slow returned: " << slow_ret.get() << std::endl;
   //empty
   cli.call<void>("empty");
+  // range
+  std::cout << "range: ";
+  cli.call_stream<int>("range", [](int i) { std::cout << i << " "; }, 0, 5);
+  std::cout << std::endl;
+  // sum
+  auto sum = cli.open_stream<long long, int>("sum");
+  for (int i = 0; i < 5; ++i)
+  {
+    sum.write(i);
+  }
+  std::cout << "sum: " << sum.finish() << std::endl;
+  // batch: one round trip for all of them
+  qwrpc::RpcClient::Batch batch;
+  auto batch_plus = batch.add<int>("plus", 2, 3);
+  auto batch_foo1 = batch.add<qwrpc_example::D>("foo1", qwrpc_example::C{2});
+  cli.call_batch(batch);
+  std::cout << "batch: " << batch_plus.get() << " " << batch_foo1.get().d << std::endl;
+  // coroutine
+  std::cout << "plus_twice: " << qwrpc::coro::sync_wait(plus_twice(cli, 1)) << std::endl;
   return 0;
 }
\ No newline at end of file
@@ -70,5 +70,12 @@ namespace qwrpc::serializer
   {
     return {str};
   }
+  
+  // C and D have no serialize() of their own, so their containers may be copied in one block.
+  template<>
+  struct is_bitwise_serializable<qwrpc_example::C> : public std::true_type {};
+  
+  template<>
+  struct is_bitwise_serializable<qwrpc_example::D> : public std::true_type {};
 }
 #endif
@@ -52,13 +52,38 @@ int main()
                         return {qwrpc_example::B{std::to_string(a.get_data() + 1)}};
                       });
   // async
+  // asynchronous: returning a std::future (or a qwrpc::coro::Task) doesn't keep a worker waiting
   svr.register_method("slow",
-                      [](std::string a) -> std::string
+                      [](std::string a) -> std::future<std::string>
                       {
-                        std::this_thread::sleep_for(10s);
-                        return a + " 10 seconds later";
+                        return std::async(std::launch::async, [a]
+                        {
+                          std::this_thread::sleep_for(10s);
+                          return a + " 10 seconds later";
+                        });
                       });
   svr.register_method("empty", [] {});
+  // streaming: every write() reaches the client right away
+  svr.register_method("range",
+                      [](qwrpc::method::Writer<int> &writer, int begin, int end)
+                      {
+                        for (int i = begin; i < end; ++i)
+                        {
+                          writer.write(i);
+                        }
+                      });
+  // client streaming: read() gets the items the client writes
+  svr.register_method("sum",
+                      [](qwrpc::method::Reader<int> &reader) -> long long
+                      {
+                        long long sum = 0;
+                        int i;
+                        while (reader.read(i))
+                        {
+                          sum += i;
+                        }
+                        return sum;
+                      });
   svr.start();
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,208 @@
+//   Copyright 2023 qwrpc - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef QWRPC_COMPRESS_HPP
+#define QWRPC_COMPRESS_HPP
+#pragma once
+
+#include "error.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace qwrpc::error::compress
+{
+  constexpr auto corrupted = "corrupted compressed data";
+  constexpr auto too_large = "decompressed data too large";
+}
+namespace qwrpc::compress
+{
+  // A byte-oriented LZ77 codec in the style of LZ4, fast enough to run on every large message.
+  // Compressed data is the uncompressed size (uint64_t), then sequences of
+  //   token: literal length (high 4 bits), match length - 4 (low 4 bits), 15 means more length bytes follow,
+  //   more literal length bytes (each 255 means another one follows), the literals,
+  //   offset of the match (uint16_t, little endian), more match length bytes.
+  // The last sequence only has literals.
+  namespace detail
+  {
+    constexpr int hash_bits = 14;
+    constexpr std::size_t min_match = 4;
+    constexpr std::size_t max_offset = 65535;
+    // The last bytes are always literals, so that matching never reads past the end.
+    constexpr std::size_t tail = 12;
+    
+    inline uint32_t read32(const char *p)
+    {
+      uint32_t v;
+      std::memcpy(&v, p, sizeof(v));
+      return v;
+    }
+    
+    inline uint32_t hash(uint32_t v) { return (v * 2654435761u) >> (32 - hash_bits); }
+    
+    inline char *write_length(char *op, std::size_t len)
+    {
+      for (; len >= 255; len -= 255) *op++ = static_cast<char>(255);
+      *op++ = static_cast<char>(len);
+      return op;
+    }
+    
+    inline std::size_t read_length(const unsigned char *&ip, const unsigned char *end)
+    {
+      std::size_t len = 0;
+      unsigned char b;
+      do
+      {
+        error::qwrpc_assert(ip < end, error::compress::corrupted);
+        b = *ip++;
+        len += b;
+      } while (b == 255);
+      return len;
+    }
+  }
+  
+  // Appends the compressed form of the n bytes at src to out. Returns false, leaving out as it was,
+  // if it would not be smaller than the input.
+  inline bool compress(const char *src, std::size_t n, std::string &out)
+  {
+    using namespace detail;
+    if (n <= tail + sizeof(uint64_t)) return false;
+    auto start = out.size();
+    out.resize(start + sizeof(uint64_t) + n + n / 255 + 16);
+    char *dst = out.data() + start;
+    uint64_t raw = n;
+    std::memcpy(dst, &raw, sizeof(raw));
+    char *op = dst + sizeof(raw);
+    // Nothing is gained once the output gets this far.
+    char *limit = dst + n - 1;
+    // Positions relative to src. Entries left by earlier calls are harmless, every candidate is compared.
+    thread_local std::vector<uint32_t> table(std::size_t(1) << hash_bits);
+    const char *ip = src;
+    const char *anchor = src;
+    const char *end = src + n;
+    const char *match_end = end - tail;
+    auto give_up = [&out, start]
+    {
+      out.resize(start);
+      return false;
+    };
+    
+    while (ip < match_end)
+    {
+      auto seq = read32(ip);
+      auto &slot = table[hash(seq)];
+      const char *ref = src + slot;
+      slot = static_cast<uint32_t>(ip - src);
+      if (ref >= ip || static_cast<std::size_t>(ip - ref) > max_offset || read32(ref) != seq)
+      {
+        // Skip faster through data that doesn't compress.
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+      while (ip > anchor && ref > src && ip[-1] == ref[-1])
+      {
+        --ip;
+        --ref;
+      }
+      std::size_t mlen = min_match;
+      while (ip + mlen < end - tail / 2 && ip[mlen] == ref[mlen]) ++mlen;
+      
+      std::size_t lit = ip - anchor;
+      if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > limit) return give_up();
+      auto token = op++;
+      *token = static_cast<char>((std::min<std::size_t>(lit, 15) << 4) | std::min<std::size_t>(mlen - min_match, 15));
+      if (lit >= 15) op = write_length(op, lit - 15);
+      std::memcpy(op, anchor, lit);
+      op += lit;
+      auto offset = static_cast<uint16_t>(ip - ref);
+      *op++ = static_cast<char>(offset & 0xff);
+      *op++ = static_cast<char>(offset >> 8);
+      if (mlen - min_match >= 15) op = write_length(op, mlen - min_match - 15);
+      ip += mlen;
+      anchor = ip;
+    }
+    
+    std::size_t lit = end - anchor;
+    if (op + 1 + lit / 255 + 1 + lit > limit) return give_up();
+    *op++ = static_cast<char>(std::min<std::size_t>(lit, 15) << 4);
+    if (lit >= 15) op = write_length(op, lit - 15);
+    std::memcpy(op, anchor, lit);
+    op += lit;
+    out.resize(op - out.data());
+    return true;
+  }
+  
+  // Replaces out with the decompressed data. Throws on malformed input and on data that would
+  // decompress to more than max_size bytes. The output grows as it is written, so a short input claiming
+  // a huge size fails before much is allocated for it.
+  inline void decompress(const char *src, std::size_t n, std::string &out, std::size_t max_size)
+  {
+    using namespace detail;
+    uint64_t raw;
+    error::qwrpc_assert(n >= sizeof(raw), error::compress::corrupted);
+    std::memcpy(&raw, src, sizeof(raw));
+    error::qwrpc_assert(raw <= max_size, error::compress::too_large);
+    // Every input byte yields at most 255 output bytes, a length byte of a long match does.
+    error::qwrpc_assert(raw <= (n - sizeof(raw)) * 255, error::compress::corrupted);
+    out.resize(std::min<uint64_t>(raw, std::max<std::size_t>(4 * n, 4096)));
+    std::size_t pos = 0;
+    // Room for len more bytes at pos.
+    auto room = [&out, &pos, raw](std::size_t len)
+    {
+      error::qwrpc_assert(len <= raw - pos, error::compress::corrupted);
+      if (out.size() - pos < len)
+      {
+        out.resize(std::min<uint64_t>(raw, std::max(pos + len, 2 * out.size())));
+      }
+      return out.data() + pos;
+    };
+    auto ip = reinterpret_cast<const unsigned char *>(src) + sizeof(raw);
+    auto iend = reinterpret_cast<const unsigned char *>(src) + n;
+    while (true)
+    {
+      error::qwrpc_assert(ip < iend, error::compress::corrupted);
+      unsigned token = *ip++;
+      std::size_t lit = token >> 4;
+      if (lit == 15) lit += read_length(ip, iend);
+      error::qwrpc_assert(lit <= static_cast<std::size_t>(iend - ip), error::compress::corrupted);
+      std::memcpy(room(lit), ip, lit);
+      ip += lit;
+      pos += lit;
+      if (ip == iend) break;
+      
+      error::qwrpc_assert(iend - ip >= 2, error::compress::corrupted);
+      std::size_t offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      error::qwrpc_assert(offset != 0 && offset <= pos, error::compress::corrupted);
+      std::size_t mlen = token & 15;
+      if (mlen == 15) mlen += read_length(ip, iend);
+      mlen += min_match;
+      // The match may overlap what it produces, copy in steps that don't.
+      char *op = room(mlen);
+      const char *ref = op - offset;
+      pos += mlen;
+      while (mlen > 0)
+      {
+        auto step = std::min<std::size_t>(mlen, op - ref);
+        std::memcpy(op, ref, step);
+        op += step;
+        mlen -= step;
+      }
+    }
+    error::qwrpc_assert(pos == raw, error::compress::corrupted);
+  }
+}
+#endif
@@ -16,6 +16,11 @@
 #pragma once
 
 #include "error.hpp"
+#include "logger.hpp"
+#include "uring.hpp"
+#include "executor.hpp"
+#include "shm.hpp"
+#include "compress.hpp"
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -25,11 +30,22 @@
 #else
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#endif
+
 #include <cstring>
 #include <functional>
 #include <string>
@@ -42,6 +58,12 @@
 #include <future>
 #include <memory>
 #include <exception>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <optional>
+#include <chrono>
 
 namespace qwrpc::error::connector
 {
@@ -49,14 +71,56 @@ namespace qwrpc::error::connector
   constexpr auto socket_bind_error = "socket bind error";
   constexpr auto socket_accept_error = "socket accept error";
   constexpr auto socket_listen_error = "socket listen error";
+  constexpr auto socket_reuseport_error = "socket SO_REUSEPORT error";
   constexpr auto socket_connect_error = "socket connect error";
   constexpr auto socket_recv_error = "socket recv error";
   constexpr auto socket_send_error = "socket send_and_recv error";
   constexpr auto socket_getpeername_error = "socket getpeername error";
+  constexpr auto socket_broken = "connection is broken";
+  constexpr auto unix_path_too_long = "unix socket path too long";
+  constexpr auto socket_fcntl_error = "socket fcntl error";
+  constexpr auto epoll_error = "epoll error";
+  constexpr auto eventfd_error = "eventfd error";
+  constexpr auto not_streaming = "this response can not be streamed";
+  constexpr auto not_uploading = "this request has no items to read";
+  constexpr auto not_deferrable = "this response can not be deferred";
+  constexpr auto frame_too_large = "frame too large";
+  constexpr auto message_too_large = "message too large";
+  constexpr auto timed_out = "call timed out";
+  constexpr auto cancelled = "call cancelled";
+  constexpr auto idle_timeout = "connection idle for too long";
+  constexpr auto keepalive_failed = "server did not answer the keepalive ping";
+  constexpr auto credit_exceeded = "stream items sent beyond the granted credit";
+  constexpr auto stream_item_too_large = "stream item larger than MAX_STREAM_ITEM";
+  constexpr auto container_format_mismatch =
+      "the server serializes containers differently, build both sides with the same QWRPC_CZH_CONTAINERS";
 }
 namespace qwrpc::connector
 {
   constexpr int MAGIC = 0x18273645;
+  // Bytes asked from the kernel per recv(), several small frames usually arrive in one.
+  constexpr std::size_t RECV_CHUNK = 65536;
+  // Where a client's reader can't be woken, how often it looks for calls past their deadline.
+  constexpr std::chrono::milliseconds READ_TICK{20};
+  // How long a server stops accepting after it ran out of fds, so that some can be closed first.
+  constexpr std::chrono::milliseconds ACCEPT_BACKOFF{100};
+  // Bytes of stream items a connection may have queued before the handler writing them blocks.
+  constexpr std::size_t STREAM_WINDOW = 4 << 20;
+  // Bytes of one item a client may upload, Client::upload() throws stream_item_too_large for larger ones.
+  // Credit is handed back in batches of a quarter window, so the client is only sure to get back three
+  // quarters of it, and an item must fit in that. Items aren't split, the handler only gets whole ones.
+  constexpr std::size_t MAX_STREAM_ITEM = STREAM_WINDOW / 2;
+  // Larger messages are sent as several frames, so that no frame needs a huge buffer up front
+  // and frames of other calls can go in between.
+  constexpr std::size_t CHUNK_SIZE = 1 << 20;
+  // Defaults of the limits in ServerConfig and ClientConfig.
+  constexpr std::size_t MAX_FRAME_SIZE = 16 << 20;
+  constexpr std::size_t MAX_MESSAGE_SIZE = std::size_t(1) << 30;
+#ifdef MSG_NOSIGNAL
+  constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+  constexpr int SEND_FLAGS = 0;
+#endif
 #ifdef _WIN32
   WSADATA qwrpc_wsa_data;
   [[maybe_unused]] int wsa_startup_err = WSAStartup(MAKEWORD(2,2),&qwrpc_wsa_data);
@@ -128,15 +192,217 @@ namespace qwrpc::connector
     }
   };
   
+  enum class FrameType : uint16_t
+  {
+    // A request, or the whole response to one.
+    message,
+    // One item of a stream, more follow. A stream from the server ends with a message.
+    stream_item,
+    // A request whose items follow as stream_items, ended by a stream_end.
+    stream_begin,
+    stream_end,
+    // Sent back as the items of a stream_begin are consumed, lets the client send that many more bytes.
+    credit,
+    // The first frame of a client, and the server's answer to it. The content is the HELLO_ flags
+    // the client asks for, and then those the server agrees to.
+    hello,
+    // The client gave up on the request of that id. Its handler sees it through Req::is_cancelled(),
+    // the response is still sent.
+    cancel,
+    // Sent by either side after a while without traffic, the other one answers with a pong.
+    // Peers that stay silent are taken for dead.
+    ping,
+    pong
+  };
+  
+  // Flags of Msg.
+  // The message goes on in the next frame of the same request_id and type.
+  constexpr uint16_t FRAME_MORE = 1;
+  // The message is compressed with compress::compress(). Set on all of its frames.
+  constexpr uint16_t FRAME_COMPRESSED = 2;
+  
+  // Flags of a hello.
+  // Large messages may be sent compressed. Compressed frames are always understood, this only tells
+  // the peer that they are welcome.
+  constexpr char HELLO_COMPRESS = 1;
+  // Requests may come in the binary envelope of envelope.hpp instead of czh.
+  constexpr char HELLO_BINARY = 2;
+  // The client asks for the server's method table (see Server::set_method_table()), which follows the flags
+  // in the server's answer if it has one.
+  constexpr char HELLO_METHODS = 4;
+  // Containers are in the binary form of serializer.hpp rather than czh. Not negotiated: each side always
+  // states its own, and a client whose format differs from the server's fails all its calls.
+  constexpr char HELLO_CONTAINERS = 8;
+#ifdef QWRPC_CZH_CONTAINERS
+  constexpr char CONTAINER_FORMAT = 0;
+#else
+  constexpr char CONTAINER_FORMAT = HELLO_CONTAINERS;
+#endif
+  
   struct Msg
   {
     int32_t magic;
+    FrameType type = FrameType::message;
+    uint16_t flags = 0;
+    // Responses carry the request_id of their request, so that one connection can have many calls in flight.
+    uint64_t request_id;
     uint64_t content_length;
   };
   
+  struct Frame
+  {
+    uint64_t request_id;
+    std::string content;
+    FrameType type = FrameType::message;
+    // FRAME_COMPRESSED if the content is, only used when sending.
+    uint16_t flags = 0;
+  };
+  
+  // Compresses the content if it has at least `min_size` bytes and gets smaller. 0 turns it off.
+  inline void compress_frame(Frame &frame, std::size_t min_size)
+  {
+    if (min_size == 0 || frame.content.size() < min_size) return;
+    std::string packed;
+    if (!compress::compress(frame.content.data(), frame.content.size(), packed)) return;
+    frame.content = std::move(packed);
+    frame.flags |= FRAME_COMPRESSED;
+  }
+  
+  // Calls f(offset, size, flags) for each frame a message of `size` bytes is sent as.
+  template<typename F>
+  void for_each_chunk(std::size_t size, F &&f)
+  {
+    std::size_t pos = 0;
+    do
+    {
+      auto n = std::min(size - pos, CHUNK_SIZE);
+      f(pos, n, pos + n < size ? FRAME_MORE : uint16_t(0));
+      pos += n;
+    } while (pos < size);
+  }
+  
+  inline void append_frame(std::string &out, const Frame &frame)
+  {
+    for_each_chunk(frame.content.size(), [&out, &frame](std::size_t pos, std::size_t n, uint16_t flags)
+    {
+      Msg msg{.magic = MAGIC, .type = frame.type, .flags = static_cast<uint16_t>(flags | frame.flags),
+              .request_id = frame.request_id, .content_length = n};
+      out.append(reinterpret_cast<const char *>(&msg), sizeof(Msg));
+      out.append(frame.content, pos, n);
+    });
+  }
+  
+  // Per-connection read buffer. Bytes are received in large chunks and cut into frames here,
+  // so short reads and several frames in one recv() are both fine. Chunked messages are put back together
+  // and compressed ones decompressed. Lengths in headers are checked before anything is allocated for them.
+  class FrameBuffer
+  {
+  private:
+    std::string data;
+    std::size_t rpos;
+    std::size_t wpos;
+    std::size_t max_frame;
+    // Bounds the sum of the messages being put together.
+    std::size_t max_message;
+    std::map<std::pair<uint64_t, FrameType>, std::string> partial;
+    std::size_t partial_size;
+  public:
+    FrameBuffer(std::size_t max_frame_ = MAX_FRAME_SIZE, std::size_t max_message_ = MAX_MESSAGE_SIZE)
+        : rpos(0), wpos(0), max_frame(max_frame_), max_message(max_message_), partial_size(0) {}
+    
+    // Returns room for at least n bytes at the end of the buffer.
+    char *prepare(std::size_t n)
+    {
+      if (rpos == wpos)
+      {
+        rpos = wpos = 0;
+      }
+      if (data.size() - wpos < n)
+      {
+        if (rpos != 0)
+        {
+          std::memmove(data.data(), data.data() + rpos, wpos - rpos);
+          wpos -= rpos;
+          rpos = 0;
+        }
+        if (data.size() - wpos < n)
+        {
+          data.resize(wpos + n);
+        }
+      }
+      return data.data() + wpos;
+    }
+    
+    void commit(std::size_t n) { wpos += n; }
+    
+    std::size_t size() const { return wpos - rpos; }
+    
+    // Bytes still needed to complete the frame at the front. 0 for an oversized one, next() rejects it.
+    std::size_t missing() const
+    {
+      if (size() < sizeof(Msg)) return sizeof(Msg) - size();
+      Msg msg;
+      std::memcpy(&msg, data.data() + rpos, sizeof(Msg));
+      if (msg.content_length > max_frame) return 0;
+      return size() - sizeof(Msg) >= msg.content_length ? 0 : msg.content_length - (size() - sizeof(Msg));
+    }
+    
+    bool next(Frame &frame)
+    {
+      while (size() >= sizeof(Msg))
+      {
+        Msg msg;
+        std::memcpy(&msg, data.data() + rpos, sizeof(Msg));
+        error::qwrpc_assert(msg.magic == MAGIC, error::connector::socket_recv_error);
+        error::qwrpc_assert(msg.content_length <= max_frame, error::connector::frame_too_large);
+        if (size() - sizeof(Msg) < msg.content_length) return false;
+        auto content = data.data() + rpos + sizeof(Msg);
+        rpos += sizeof(Msg) + msg.content_length;
+        auto it = partial.find({msg.request_id, msg.type});
+        if (it == partial.end() && !(msg.flags & FRAME_MORE))
+        {
+          frame.request_id = msg.request_id;
+          frame.type = msg.type;
+          if (msg.flags & FRAME_COMPRESSED)
+          {
+            compress::decompress(content, msg.content_length, frame.content, max_message);
+          }
+          else
+          {
+            frame.content.assign(content, msg.content_length);
+          }
+          return true;
+        }
+        error::qwrpc_assert(partial_size + msg.content_length <= max_message, error::connector::message_too_large);
+        if (it == partial.end())
+        {
+          it = partial.emplace(std::make_pair(msg.request_id, msg.type), std::string()).first;
+        }
+        it->second.append(content, msg.content_length);
+        partial_size += msg.content_length;
+        if (msg.flags & FRAME_MORE) continue;
+        frame.request_id = msg.request_id;
+        frame.type = msg.type;
+        partial_size -= it->second.size();
+        if (msg.flags & FRAME_COMPRESSED)
+        {
+          compress::decompress(it->second.data(), it->second.size(), frame.content, max_message);
+        }
+        else
+        {
+          frame.content = std::move(it->second);
+        }
+        partial.erase(it);
+        return true;
+      }
+      return false;
+    }
+  };
+  
+  // An AF_INET or AF_UNIX address.
   struct Addr
   {
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
 #ifdef _WIN32
     int len;
 #else
@@ -148,36 +414,69 @@ namespace qwrpc::connector
       std::memset(&addr, 0, sizeof(addr));
     }
     
-    Addr(struct sockaddr_in addr_, decltype(len) len_)
+    Addr(const struct sockaddr_storage &addr_, decltype(len) len_)
         : addr(addr_), len(len_) {}
     
     Addr(const std::string &ip, int port)
     {
       std::memset(&addr, 0, sizeof(addr));
-      addr.sin_family = AF_INET;
-      addr.sin_addr.s_addr = inet_addr(ip.c_str());
-      addr.sin_port = htons(port);
-      len = sizeof(addr);
+      auto in = reinterpret_cast<sockaddr_in *>(&addr);
+      in->sin_family = AF_INET;
+      in->sin_addr.s_addr = inet_addr(ip.c_str());
+      in->sin_port = htons(port);
+      len = sizeof(sockaddr_in);
     }
     
     Addr(int port)
     {
       std::memset(&addr, 0, sizeof(addr));
-      addr.sin_family = AF_INET;
-      addr.sin_addr.s_addr = INADDR_ANY;
-      addr.sin_port = htons(port);
-      len = sizeof(addr);
+      auto in = reinterpret_cast<sockaddr_in *>(&addr);
+      in->sin_family = AF_INET;
+      in->sin_addr.s_addr = INADDR_ANY;
+      in->sin_port = htons(port);
+      len = sizeof(sockaddr_in);
+    }
+
+#ifndef _WIN32
+    // Same-host peers can skip the loopback TCP stack.
+    static Addr unix_socket(const std::string &path)
+    {
+      Addr ret;
+      auto un = reinterpret_cast<sockaddr_un *>(&ret.addr);
+      error::qwrpc_assert(path.size() < sizeof(un->sun_path), error::connector::unix_path_too_long);
+      un->sun_family = AF_UNIX;
+      std::memcpy(un->sun_path, path.c_str(), path.size() + 1);
+      ret.len = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size() + 1);
+      return ret;
     }
+#endif
+    
+    int family() const { return addr.ss_family; }
+    
+    sockaddr *get() { return reinterpret_cast<sockaddr *>(&addr); }
+    
+    const sockaddr *get() const { return reinterpret_cast<const sockaddr *>(&addr); }
     
     std::string to_string() const
     {
-      std::string str(16, '\0');
+#ifndef _WIN32
+      if (family() == AF_UNIX)
+      {
+        auto un = reinterpret_cast<const sockaddr_un *>(&addr);
+        // Connecting peers are usually unnamed.
+        if (len <= offsetof(sockaddr_un, sun_path)) return "unix:";
+        return std::string("unix:") + un->sun_path;
+      }
+#endif
+      auto in = reinterpret_cast<const sockaddr_in *>(&addr);
 #ifdef _WIN32
-      str = inet_ntoa(addr.sin_addr);
+      std::string str = inet_ntoa(in->sin_addr);
 #else
-      inet_ntop(AF_INET, &addr.sin_addr, str.data(), len);
+      char buf[INET_ADDRSTRLEN] = {0};
+      inet_ntop(AF_INET, &in->sin_addr, buf, sizeof(buf));
+      std::string str = buf;
 #endif
-      str += ":" + std::to_string(ntohs(addr.sin_port));
+      str += ":" + std::to_string(ntohs(in->sin_port));
       return str;
     }
   };
@@ -196,8 +495,21 @@ namespace qwrpc::connector
     Socket() : fd(-1)
     {
       fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+      error::qwrpc_assert(fd != -1, error::connector::socket_init_error);
       int on = 1;
       setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char *>(&on), sizeof(on));
+      set_nodelay();
+    }
+    
+    // A stream socket of the family of `addr`.
+    explicit Socket(const Addr &addr) : fd(-1)
+    {
+      if (addr.family() == AF_INET)
+      {
+        *this = Socket();
+        return;
+      }
+      fd = socket(addr.family(), SOCK_STREAM, 0);
       error::qwrpc_assert(fd != -1, error::connector::socket_init_error);
     }
     
@@ -205,11 +517,22 @@ namespace qwrpc::connector
     
     Socket(const Socket &) = delete;
     
-    Socket(Socket &&soc) : fd(soc.fd)
+    Socket(Socket &&soc) noexcept: fd(soc.fd)
     {
       soc.fd = -1;
     }
     
+    Socket &operator=(Socket &&soc)
+    {
+      if (this != &soc)
+      {
+        if (fd != -1) ::close(fd);
+        fd = soc.fd;
+        soc.fd = -1;
+      }
+      return *this;
+    }
+    
     ~Socket()
     {
       if (fd != -1)
@@ -223,47 +546,198 @@ namespace qwrpc::connector
     {
       Addr addr;
 #ifdef _WIN32
-      return {std::move(Socket{::accept(fd, reinterpret_cast<sockaddr *>(&addr.addr),
-                                        reinterpret_cast<int *> (&addr.len))}), addr};
+      Socket clnt{::accept(fd, addr.get(), reinterpret_cast<int *> (&addr.len))};
 #else
-      return {std::move(Socket{::accept(fd, reinterpret_cast<sockaddr *>(&addr.addr),
-                                        reinterpret_cast<socklen_t *>(&addr.len))}), addr};
+      Socket clnt{::accept(fd, addr.get(), reinterpret_cast<socklen_t *>(&addr.len))};
 #endif
+      if (clnt.get_fd() != -1 && addr.family() == AF_INET) clnt.set_nodelay();
+      return {std::move(clnt), addr};
     }
     
     int get_fd() const { return fd; }
     
-    void send(const std::string &str) const
+    void set_nonblocking() const
+    {
+#ifdef _WIN32
+      u_long on = 1;
+      error::qwrpc_assert(ioctlsocket(fd, FIONBIO, &on) == 0, error::connector::socket_fcntl_error);
+#else
+      int flags = fcntl(fd, F_GETFL, 0);
+      error::qwrpc_assert(flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1,
+                          error::connector::socket_fcntl_error);
+#endif
+    }
+    
+    // Small RPCs are latency bound, don't let Nagle hold them back.
+    void set_nodelay() const
+    {
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char *>(&on), sizeof(on));
+    }
+    
+    // Lets the kernel probe a peer that has been silent for `idle`, so that a dead one fails recv() and send().
+    // 0 leaves it off. TCP only.
+    void set_keepalive(std::chrono::seconds idle) const
+    {
+      if (idle.count() == 0) return;
+      int on = 1;
+      setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, reinterpret_cast<char *>(&on), sizeof(on));
+#ifdef TCP_KEEPIDLE
+      int secs = static_cast<int>(idle.count());
+      int interval = std::max(secs / 3, 1);
+      int count = 3;
+      setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &secs, sizeof(secs));
+      setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+      setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+    }
+    
+    // Makes recv() give up after `timeout` without data, 0 waits forever.
+    void set_recv_timeout(std::chrono::milliseconds timeout) const
+    {
+#ifdef _WIN32
+      DWORD ms = static_cast<DWORD>(timeout.count());
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<char *>(&ms), sizeof(ms));
+#else
+      timeval tv{};
+      tv.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+      tv.tv_usec = static_cast<suseconds_t>(timeout.count() % 1000 * 1000);
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#endif
+    }
+    
+    // Messages over CHUNK_SIZE go out as several frames, all of them with `flags`.
+    void send(const std::string &str, uint64_t request_id = 0, FrameType type = FrameType::message,
+              uint16_t flags = 0) const
+    {
+      for_each_chunk(str.size(), [this, &str, request_id, type, flags](std::size_t pos, std::size_t n, uint16_t more)
+      {
+        send_frame(str.data() + pos, n, request_id, type, flags | more);
+      });
+    }
+    
+    void send(const Frame &frame) const
+    {
+      send(frame.content, frame.request_id, frame.type, frame.flags);
+    }
+    
+    // Header and payload leave in one syscall.
+    void send_frame(const char *data, std::size_t size, uint64_t request_id, FrameType type, uint16_t flags) const
+    {
+      Msg msg{.magic = MAGIC, .type = type, .flags = flags, .request_id = request_id, .content_length = size};
+#ifdef _WIN32
+      std::string buf;
+      buf.reserve(sizeof(Msg) + size);
+      buf.append(reinterpret_cast<const char *>(&msg), sizeof(Msg));
+      buf.append(data, size);
+      std::size_t sent = 0;
+      while (sent < buf.size())
+      {
+        auto n = ::send(fd, buf.data() + sent, static_cast<int>(buf.size() - sent), 0);
+        error::qwrpc_assert(n >= 0, error::connector::socket_send_error);
+        sent += n;
+      }
+#else
+      iovec iov[2];
+      iov[0].iov_base = &msg;
+      iov[0].iov_len = sizeof(Msg);
+      iov[1].iov_base = const_cast<char *>(data);
+      iov[1].iov_len = size;
+      msghdr mh{};
+      mh.msg_iov = iov;
+      mh.msg_iovlen = 2;
+      while (mh.msg_iovlen > 0)
+      {
+        auto n = ::sendmsg(fd, &mh, SEND_FLAGS);
+        if (n == -1 && errno == EINTR) continue;
+        error::qwrpc_assert(n >= 0, error::connector::socket_send_error);
+        // skip what has been sent
+        while (mh.msg_iovlen > 0 && static_cast<std::size_t>(n) >= mh.msg_iov->iov_len)
+        {
+          n -= mh.msg_iov->iov_len;
+          ++mh.msg_iov;
+          --mh.msg_iovlen;
+        }
+        if (mh.msg_iovlen > 0)
+        {
+          mh.msg_iov->iov_base = static_cast<char *>(mh.msg_iov->iov_base) + n;
+          mh.msg_iov->iov_len -= n;
+        }
+      }
+#endif
+    }
+    
+    Frame recv(FrameBuffer &buf) const
+    {
+      Frame frame;
+      error::qwrpc_assert(recv(buf, frame), error::connector::socket_recv_error);
+      return frame;
+    }
+    
+    // Reads once, whatever is there. For a socket that poll() found readable, so that it doesn't block.
+    void recv_some(FrameBuffer &buf) const
     {
-      Msg msg{.magic = MAGIC, .content_length = str.size()};
-      error::qwrpc_assert(::send(fd, reinterpret_cast<char *>(&msg), sizeof(Msg), 0) >= 0,
-                          error::connector::socket_send_error);
-      error::qwrpc_assert(::send(fd, str.data(), str.size(), 0) >= 0,
-                          error::connector::socket_send_error);
+      auto want = std::max(RECV_CHUNK, buf.missing());
+#ifdef _WIN32
+      auto n = ::recv(fd, buf.prepare(want), static_cast<int>(want), 0);
+#else
+      auto n = ::recv(fd, buf.prepare(want), want, 0);
+      if (n == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return;
+#endif
+      error::qwrpc_assert(n > 0, error::connector::socket_recv_error);
+      buf.commit(n);
     }
     
-    std::string recv() const
+    // Returns false if the timeout of set_recv_timeout() expired first.
+    bool recv(FrameBuffer &buf, Frame &frame) const
     {
-      Msg msg_recv;
-      error::qwrpc_assert(
-          ::recv(fd, reinterpret_cast<char *>(&msg_recv), sizeof(Msg), 0) == sizeof(Msg)
-          && msg_recv.magic == MAGIC, error::connector::socket_recv_error);
-      std::string recv_result(msg_recv.content_length, 0);
-      error::qwrpc_assert(::recv(fd, &recv_result[0], msg_recv.content_length, 0) == msg_recv.content_length,
-                          error::connector::socket_recv_error);
-      return recv_result;
+      while (!buf.next(frame))
+      {
+        auto want = std::max(RECV_CHUNK, buf.missing());
+#ifdef _WIN32
+        auto n = ::recv(fd, buf.prepare(want), static_cast<int>(want), 0);
+        if (n == -1 && WSAGetLastError() == WSAETIMEDOUT) return false;
+#else
+        auto n = ::recv(fd, buf.prepare(want), want, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+#endif
+        error::qwrpc_assert(n > 0, error::connector::socket_recv_error);
+        buf.commit(n);
+      }
+      return true;
     }
     
     void bind(Addr addr) const
     {
+#ifndef _WIN32
+      if (addr.family() == AF_UNIX)
+      {
+        // A socket file left by a previous run would make bind() fail. Anything else at that path is kept,
+        // bind() reports it.
+        auto path = reinterpret_cast<const sockaddr_un *>(&addr.addr)->sun_path;
+        struct stat st{};
+        if (::lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) ::unlink(path);
+      }
+#endif
       error::qwrpc_assert(::bind(fd, (sockaddr *) &addr.addr, addr.len) == 0,
                           error::connector::socket_bind_error);
     }
     
-    void listen() const
+    void listen(int backlog = SOMAXCONN) const
+    {
+      error::qwrpc_assert(::listen(fd, backlog) != -1, error::connector::socket_listen_error);
+    }
+
+#ifdef SO_REUSEPORT
+    // Several sockets may then bind the same port, the kernel spreads incoming connections across them.
+    void set_reuseport() const
     {
-      error::qwrpc_assert(::listen(fd, 0) != -1, error::connector::socket_listen_error);
+      int on = 1;
+      error::qwrpc_assert(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0,
+                          error::connector::socket_reuseport_error);
     }
+#endif
     
     void connect(Addr addr) const
     {
@@ -273,102 +747,3240 @@ namespace qwrpc::connector
     
     Addr get_peer_addr() const
     {
-      struct sockaddr_in peer_addr;
-      decltype(Addr::len) peer_len;
-      peer_len = sizeof(peer_addr);
-      error::qwrpc_assert(getpeername(fd, (struct sockaddr *) &peer_addr, &peer_len) != -1,
+      Addr peer;
+      error::qwrpc_assert(getpeername(fd, peer.get(), &peer.len) != -1,
                           error::connector::socket_getpeername_error);
-      return Addr(peer_addr, peer_len);
+      return peer;
+    }
+  };
+  
+  inline std::string encode_credit(uint64_t bytes)
+  {
+    return {reinterpret_cast<const char *>(&bytes), sizeof(bytes)};
+  }
+  
+  inline uint64_t decode_credit(const std::string &content)
+  {
+    uint64_t bytes = 0;
+    std::memcpy(&bytes, content.data(), std::min(content.size(), sizeof(bytes)));
+    return bytes;
+  }
+  
+  // The items of a stream_begin request on their way to its handler. Reading them hands out credit,
+  // so a client never has more than about STREAM_WINDOW bytes waiting in here.
+  class Inbox
+  {
+  public:
+    // Sends credit for that many bytes back to the client.
+    using Grant = std::function<void(std::size_t)>;
+    // Reads the next frame of the connection itself, for connectors without a loop that would push().
+    using Fill = std::function<void()>;
+  private:
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::deque<std::string> items;
+    bool ended;
+    bool closed;
+    std::size_t consumed;
+    // What the client may still send. It only sends an item once its own count covers it, and that is
+    // never more than this one, so an item arriving beyond this breaks the protocol.
+    int64_t credit;
+    Grant grant;
+    Fill fill;
+  public:
+    explicit Inbox(Grant grant_, Fill fill_ = nullptr)
+        : ended(false), closed(false), consumed(0), credit(STREAM_WINDOW), grant(std::move(grant_)),
+          fill(std::move(fill_)) {}
+    
+    // Returns false without taking the item if the client had no credit left for it.
+    // The connection should be closed then, or the client could make us buffer without limit.
+    bool push(std::string &&item)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (credit <= 0 || static_cast<int64_t>(item.size()) > credit) return false;
+        credit -= static_cast<int64_t>(item.size());
+        items.emplace_back(std::move(item));
+      }
+      cond.notify_one();
+      return true;
+    }
+    
+    void end()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        ended = true;
+      }
+      cond.notify_one();
+    }
+    
+    // The connection is gone, pop() throws from then on.
+    void close()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        closed = true;
+      }
+      cond.notify_one();
+    }
+    
+    // Returns false once the client ended the stream.
+    bool pop(std::string &item)
+    {
+      std::size_t granted = 0;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (items.empty() && !ended && !closed)
+        {
+          if (fill == nullptr)
+          {
+            cond.wait(lock);
+            continue;
+          }
+          lock.unlock();
+          fill();
+          lock.lock();
+        }
+        error::qwrpc_assert(!closed, error::connector::socket_broken);
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        // Credit goes back in batches, not a frame per item.
+        consumed += item.size();
+        if (consumed >= STREAM_WINDOW / 4)
+        {
+          granted = consumed;
+          consumed = 0;
+          credit += static_cast<int64_t>(granted);
+        }
+      }
+      if (granted != 0) grant(granted);
+      return true;
+    }
+  };
+  
+  // Calls of a connection the client cancelled while they were in flight. The loop adds to it,
+  // handlers look it up from the workers.
+  class CancelSet
+  {
+  private:
+    mutable std::mutex mtx;
+    std::unordered_set<uint64_t> ids;
+    // Keeps the lock off the lookups while nothing is cancelled.
+    std::atomic<bool> any;
+  public:
+    CancelSet() : any(false) {}
+    
+    void add(uint64_t id)
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      ids.insert(id);
+      any.store(true, std::memory_order_relaxed);
+    }
+    
+    bool contains(uint64_t id) const
+    {
+      if (!any.load(std::memory_order_relaxed)) return false;
+      std::lock_guard<std::mutex> lock(mtx);
+      return ids.count(id) != 0;
+    }
+    
+    // Called once a call was answered. If nothing is in flight anymore, cancels that came after their
+    // call was answered are dropped too.
+    void finish(uint64_t id, bool idle)
+    {
+      if (!any.load(std::memory_order_relaxed)) return;
+      std::lock_guard<std::mutex> lock(mtx);
+      if (idle)
+      {
+        ids.clear();
+      }
+      else
+      {
+        ids.erase(id);
+      }
+      any.store(!ids.empty(), std::memory_order_relaxed);
     }
   };
   
   class Req
   {
+  public:
+    using Clock = std::chrono::steady_clock;
+    // Whether the client cancelled the call, set by the connector for the duration of the call.
+    using Cancelled = std::function<bool()>;
   private:
     std::string ip;
     std::string content;
+    std::shared_ptr<Inbox> inbox;
+    Clock::time_point received;
+    Cancelled cancelled;
   public:
-    Req(const std::string &ip_, const std::string &content_)
-        : ip(ip_), content(content_) {}
+    Req(const std::string &ip_, const std::string &content_, std::shared_ptr<Inbox> inbox_ = nullptr,
+        Clock::time_point received_ = Clock::now(), Cancelled cancelled_ = nullptr)
+        : ip(ip_), content(content_), inbox(std::move(inbox_)), received(received_),
+          cancelled(std::move(cancelled_)) {}
+    
+    const std::string &get_ip() const { return ip; }
+    
+    const std::string &get_content() const { return content; }
+    
+    // When the request arrived, before it waited for a worker. Deadlines count from here.
+    Clock::time_point get_received() const { return received; }
     
-    auto get_ip() const { return ip; }
+    // Polled by long-running handlers, the caller isn't waiting for the response anymore.
+    bool is_cancelled() const { return cancelled != nullptr && cancelled(); }
     
-    auto get_content() const { return content; }
+    // The next item a client-streaming call sent after its request, false once it ended the stream.
+    // Blocks until one arrives.
+    bool read(std::string &item) const
+    {
+      error::qwrpc_assert(inbox != nullptr, error::connector::not_uploading);
+      return inbox->pop(item);
+    }
   };
   
   class Res
   {
+  public:
+    // Sends one stream item, set by the connector for the duration of the call.
+    using Writer = std::function<void(std::string &&)>;
+    // Sends a deferred response, may be called from any thread.
+    using Done = std::function<void(std::string &&)>;
+    // Set by the connector for the duration of the call, makes the Done of a deferred response.
+    using Deferrer = std::function<Done()>;
   private:
     std::string content;
+    Writer writer;
+    Deferrer deferrer;
+    bool streaming;
+    bool deferred;
   public:
-    Res() = default;
+    Res() : streaming(false), deferred(false) {}
+    
+    explicit Res(Writer writer_, Deferrer deferrer_ = nullptr)
+        : writer(std::move(writer_)), deferrer(std::move(deferrer_)), streaming(false), deferred(false) {}
     
-    void set_content(const std::string c) { content = c; }
+    void set_content(std::string c) { content = std::move(c); }
+    
+    const std::string &get_content() const { return content; }
+    
+    // Sends `item` to the client right away, the content set at the end follows as the last frame.
+    // Blocks while the client lags more than STREAM_WINDOW behind.
+    void write(std::string item)
+    {
+      error::qwrpc_assert(writer != nullptr, error::connector::not_streaming);
+      streaming = true;
+      writer(std::move(item));
+    }
+    
+    bool is_streaming() const { return streaming; }
+    
+    // Nothing is sent when the router returns, the response goes out when the returned Done is called.
+    // The reactors don't keep a worker for it meanwhile. Not for streaming responses.
+    Done defer()
+    {
+      error::qwrpc_assert(deferrer != nullptr && !streaming, error::connector::not_deferrable);
+      deferred = true;
+      return deferrer();
+    }
     
-    auto get_content() const { return content; }
+    bool is_deferred() const { return deferred; }
   };
   
-  class Server
+  // Stream items a connection has queued but not sent yet. Workers writing items take from it,
+  // the loop gives back what it sent. Other responses on the connection give back too, so the bound is loose.
+  class StreamWindow
   {
   private:
-    int port;
-    bool running;
-    std::function<void(const Req &, Res &)> router;
-    Thpool thpool;
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::atomic<std::size_t> queued;
+    bool closed;
   public:
-    Server(int p, const std::function<void(const Req &, Res &)> &router_)
-        : port(p), router(router_), thpool(16), running(false) {}
+    StreamWindow() : queued(0), closed(false) {}
     
-    void start()
+    void acquire(std::size_t n)
     {
-      running = true;
-      Socket socket;
-      socket.bind({port});
-      socket.listen();
-      while (running)
+      std::unique_lock<std::mutex> lock(mtx);
+      cond.wait(lock, [this] { return closed || queued.load(std::memory_order_relaxed) < STREAM_WINDOW; });
+      error::qwrpc_assert(!closed, error::connector::socket_broken);
+      queued.fetch_add(n, std::memory_order_relaxed);
+    }
+    
+    void release(std::size_t n)
+    {
+      // Only connections that stream pay for the lock.
+      if (queued.load(std::memory_order_relaxed) == 0) return;
       {
-        auto tmp = socket.accept();
-        auto&[clnt_socket, clnt_addr] = tmp;
-        error::qwrpc_assert(clnt_socket.get_fd() != -1, error::connector::socket_accept_error);
-        thpool.add_task(
-            [this, clnt_socket = std::move(std::get<0>(tmp))]
-            {
-              while (true)
-              {
-                auto request = clnt_socket.recv();
-                if (request == "quit")
-                {
-                  break;
-                }
-                Res response;
-                router(Req{clnt_socket.get_peer_addr().to_string(), request}, response);
-                clnt_socket.send(response.get_content());
-              }
-            });
+        std::lock_guard<std::mutex> lock(mtx);
+        queued.fetch_sub(std::min(n, queued.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+      }
+      cond.notify_all();
+    }
+    
+    // Wakes the writers, they throw from then on.
+    void close()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        closed = true;
       }
+      cond.notify_all();
     }
   };
   
-  class Client
+  using Router = std::function<void(const Req &, Res &)>;
+  
+  enum class ServerMode
+  {
+    // Every connection pins a worker for its whole lifetime.
+    thread_per_connection,
+    // Connections are multiplexed on a few epoll loops, only complete frames go to the workers.
+    reactor,
+    // Like reactor, but on io_uring loops. Falls back to reactor if io_uring is unavailable.
+    io_uring
+  };
+  
+  struct ServerConfig
+  {
+#ifdef __linux__
+    ServerMode mode = ServerMode::reactor;
+#else
+    ServerMode mode = ServerMode::thread_per_connection;
+#endif
+    std::size_t io_threads = 1;
+    std::size_t workers = 16;
+    int backlog = SOMAXCONN;
+    // reactor and io_uring on TCP only: if > 1, that many listening sockets share the port with SO_REUSEPORT,
+    // each with its own loop, which accepts by itself, and its own share of the workers. Replaces io_threads.
+    std::size_t shards = 1;
+    // Limits, 0 means unlimited. A request over a limit is answered with Server's overloaded response
+    // right away instead of waiting.
+    // Requests waiting for a worker, per shard.
+    std::size_t max_queued = 0;
+    // Connections over it are closed as soon as they are accepted.
+    std::size_t max_connections = 0;
+    // Requests of one connection being handled at the same time, reactor and io_uring only.
+    std::size_t max_in_flight = 0;
+    // A connection sending a frame over max_frame_size, or more than max_message_size of chunked messages
+    // at once, is closed.
+    std::size_t max_frame_size = MAX_FRAME_SIZE;
+    std::size_t max_message_size = MAX_MESSAGE_SIZE;
+    // Whether clients asking for it in their hello get responses of at least compress_min_size bytes compressed.
+    bool compression = true;
+    std::size_t compress_min_size = 1024;
+    // Whether clients asking for it may send the binary envelope, they send czh otherwise.
+    bool binary_envelope = true;
+    // io_uring only: submission queue entries and registered receive buffers of each loop.
+    unsigned uring_entries = 256;
+    std::size_t uring_buffers = 64;
+    // reactor only: if not empty, co-located clients in ClientMode::shared_memory connect to this Unix socket
+    // and then talk through shared memory rings.
+    std::string shm_path;
+    // A connection that sent nothing for this long is closed, 0 keeps connections open. It is pinged half way,
+    // so clients that are alive answer and stay. Connections with calls being handled don't count as idle.
+    std::chrono::milliseconds idle_timeout{0};
+    // TCP keepalive probes after this much silence, 0 leaves them off.
+    std::chrono::seconds tcp_keepalive{0};
+  };
+  
+  // How often each limit of ServerConfig was hit.
+  struct ServerStats
+  {
+    uint64_t queue_full = 0;
+    uint64_t too_many_connections = 0;
+    uint64_t too_many_in_flight = 0;
+    std::size_t connections = 0;
+    // Closed by ServerConfig::idle_timeout.
+    uint64_t idle_closed = 0;
+  };
+  
+  // The HELLO_ flags a server with `config` agrees to, out of those a client asked for in `hello`.
+  inline char accept_hello(const ServerConfig &config, const std::string &hello)
+  {
+    if (hello.empty()) return 0;
+    char ret = 0;
+    if (config.compression) ret |= hello[0] & HELLO_COMPRESS;
+    if (config.binary_envelope) ret |= hello[0] & HELLO_BINARY;
+    return static_cast<char>(ret | CONTAINER_FORMAT);
+  }
+  
+  enum class Idle { active, ping, expired };
+  
+  // How a connection last heard from at `last_recv` stands against ServerConfig::idle_timeout.
+  // It is pinged once half way, `busy` ones are never idle.
+  inline Idle check_idle(std::chrono::steady_clock::time_point &last_recv, bool &pinged, bool busy,
+                         std::chrono::steady_clock::time_point now, std::chrono::milliseconds timeout)
+  {
+    if (busy)
+    {
+      last_recv = now;
+      pinged = false;
+      return Idle::active;
+    }
+    auto elapsed = now - last_recv;
+    if (elapsed >= timeout) return Idle::expired;
+    if (!pinged && elapsed >= timeout / 2)
+    {
+      pinged = true;
+      return Idle::ping;
+    }
+    return Idle::active;
+  }
+  
+  // How often the loops look for idle connections.
+  inline std::chrono::milliseconds idle_tick(std::chrono::milliseconds timeout)
+  {
+    return std::max(timeout / 4, std::chrono::milliseconds(10));
+  }
+  
+  // Limits and counters shared by the loops of one Server.
+  class Admission
   {
-  private:
-    Socket socket;
   public:
-    ~Client()
+    const ServerConfig &config;
+    std::string overloaded;
+    // What a request whose router threw gets back.
+    std::string failed;
+    std::atomic<std::size_t> connections;
+    std::atomic<uint64_t> queue_full;
+    std::atomic<uint64_t> too_many_connections;
+    std::atomic<uint64_t> too_many_in_flight;
+    std::atomic<uint64_t> idle_closed;
+    std::string method_table;
+    
+    explicit Admission(const ServerConfig &config_)
+        : config(config_), connections(0), queue_full(0), too_many_connections(0), too_many_in_flight(0),
+          idle_closed(0) {}
+    
+    // Every admitted connection needs a release_connection().
+    bool admit_connection()
     {
-      socket.send("quit");
+      auto n = connections.fetch_add(1, std::memory_order_relaxed) + 1;
+      if (config.max_connections != 0 && n > config.max_connections)
+      {
+        connections.fetch_sub(1, std::memory_order_relaxed);
+        too_many_connections.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      return true;
     }
     
-    void connect(const std::string &addr, int port)
+    void release_connection() { connections.fetch_sub(1, std::memory_order_relaxed); }
+    
+    bool admit_request(std::size_t in_flight)
     {
-      socket.connect({addr, port});
+      if (config.max_in_flight != 0 && in_flight >= config.max_in_flight)
+      {
+        too_many_in_flight.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      return true;
     }
-  
-    std::string send_and_recv(const std::string &str)
+    
+    ServerStats stats() const
     {
-      socket.send(str);
-      return socket.recv();
+      return {queue_full.load(), too_many_connections.load(), too_many_in_flight.load(), connections.load(),
+              idle_closed.load()};
     }
   };
-}
-#endif
\ No newline at end of file
+  
+  // A router that throws still answers, with Admission::failed, unless it deferred the response already.
+  inline void route(const Router &router, const Req &request, Res &response, const Admission &admission)
+  {
+    try
+    {
+      router(request, response);
+      return;
+    }
+    catch (std::exception &err)
+    {
+      logger::error(logger::no_fmt, "Router failed: ", err.what());
+    }
+    catch (...)
+    {
+      logger::error(logger::no_fmt, "Router failed: unknown exception");
+    }
+    if (!response.is_deferred()) response.set_content(admission.failed);
+  }
+  
+  // The server's answer to a hello: the flags it agrees to, then its method table if the client asked for it.
+  inline std::string answer_hello(const Admission &admission, const std::string &hello)
+  {
+    std::string ret(1, accept_hello(admission.config, hello));
+    if (!hello.empty() && (hello[0] & HELLO_CONTAINERS) != CONTAINER_FORMAT)
+    {
+      logger::warn(logger::no_fmt, "Client serializes containers differently, its calls will fail");
+    }
+    if (!hello.empty() && (hello[0] & HELLO_METHODS) && !admission.method_table.empty())
+    {
+      ret[0] = static_cast<char>(ret[0] | HELLO_METHODS);
+      ret += admission.method_table;
+    }
+    return ret;
+  }
+  
+  // Deferred responses may be completed after their loop is gone, by a coroutine resumed late for example.
+  // They reach the loop through this, and are dropped once it has been reset().
+  template<typename Loop>
+  class LoopHandle
+  {
+  private:
+    std::mutex mtx;
+    Loop *loop;
+  public:
+    explicit LoopHandle(Loop *loop_) : loop(loop_) {}
+    
+    template<typename F>
+    void with(F &&f)
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (loop != nullptr) f(*loop);
+    }
+    
+    // Waits for the completions running right now.
+    void reset()
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      loop = nullptr;
+    }
+  };
+
+#ifdef __linux__
+  // What a connection of the event loops holds apart from how its bytes are moved.
+  struct LoopConnection
+  {
+    Socket socket;
+    std::string peer;
+    FrameBuffer rbuf;
+    bool closed;
+    // Being handled by the workers.
+    std::size_t requests;
+    StreamWindow window;
+    // Client-streaming calls whose items are still coming, by request id.
+    std::unordered_map<uint64_t, std::shared_ptr<Inbox>> uploads;
+    // Set by the hello, responses of at least that many bytes are compressed. 0 if they aren't.
+    std::atomic<std::size_t> compress_min;
+    CancelSet cancels;
+    // For ServerConfig::idle_timeout.
+    std::chrono::steady_clock::time_point last_recv;
+    bool pinged;
+    
+    LoopConnection(Socket &&socket_, std::string peer_, const ServerConfig &config)
+        : socket(std::move(socket_)), peer(std::move(peer_)), rbuf(config.max_frame_size, config.max_message_size),
+          closed(false), requests(0), compress_min(0), last_recv(std::chrono::steady_clock::now()), pinged(false) {}
+  };
+  
+  // The protocol shared by Reactor and UringReactor: frames in, requests to the workers, responses back to the loop.
+  // `Loop` only moves bytes. It provides
+  //   wakeup()                  - makes the loop pick up `completed`, callable from any thread
+  //   outbox(conn)              - the buffer frames for `conn` are appended to
+  //   flush(conn)               - sends what is in the outbox
+  //   close(conn)               - calls mark_closed() and releases the connection's I/O
+  //   for_each_connection(f)    - calls `f` once for every open connection
+  template<typename Loop, typename Connection>
+  class LoopBase
+  {
+  protected:
+    using ConnPtr = std::shared_ptr<Connection>;
+    
+    // Handed over from the workers, guarded by mtx.
+    std::mutex mtx;
+    std::vector<std::pair<std::weak_ptr<Connection>, Frame>> completed;
+    const Router &router;
+    executor::Executor &executor;
+    Admission &admission;
+    const ServerConfig &config;
+    // Captured by deferred responses instead of this.
+    std::shared_ptr<LoopHandle<LoopBase>> self;
+    
+    LoopBase(const Router &router_, executor::Executor &executor_, Admission &admission_,
+             const ServerConfig &config_)
+        : router(router_), executor(executor_), admission(admission_), config(config_),
+          self(std::make_shared<LoopHandle<LoopBase>>(this)) {}
+    
+    LoopBase(const LoopBase &) = delete;
+    
+    Loop &derived() { return static_cast<Loop &>(*this); }
+    
+    // Called by the workers.
+    void complete(const std::weak_ptr<Connection> &conn, Frame &&response)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        completed.emplace_back(conn, std::move(response));
+      }
+      derived().wakeup();
+    }
+    
+    // Queues a response taken from `completed`. Returns null if its connection is gone.
+    ConnPtr take_response(const std::weak_ptr<Connection> &weak_conn, const Frame &response)
+    {
+      auto conn = weak_conn.lock();
+      if (conn == nullptr || conn->closed) return nullptr;
+      if (response.type == FrameType::message)
+      {
+        --conn->requests;
+        conn->cancels.finish(response.request_id, conn->requests == 0);
+      }
+      append_frame(derived().outbox(conn), response);
+      return conn;
+    }
+    
+    // Returns false if the connection was closed.
+    bool parse_frames(const ConnPtr &conn)
+    {
+      Frame frame;
+      while (true)
+      {
+        try
+        {
+          if (!conn->rbuf.next(frame)) return true;
+        }
+        catch (error::Error &err)
+        {
+          logger::warn(logger::no_fmt, err.get_detail(), ": bad frame from ", conn->peer);
+          derived().close(conn);
+          return false;
+        }
+        if (frame.content == "quit")
+        {
+          derived().close(conn);
+          return false;
+        }
+        on_frame(conn, std::move(frame));
+        if (conn->closed) return false;
+      }
+    }
+    
+    // Pipelined requests on one connection are handled concurrently, responses may go out of order.
+    void on_frame(const ConnPtr &conn, Frame &&frame)
+    {
+      switch (frame.type)
+      {
+        case FrameType::message:
+        case FrameType::stream_begin:
+          dispatch(conn, std::move(frame));
+          break;
+        case FrameType::stream_item:
+        {
+          // Items of a rejected or already answered call are dropped.
+          auto it = conn->uploads.find(frame.request_id);
+          if (it != conn->uploads.end() && !it->second->push(std::move(frame.content)))
+          {
+            logger::warn(logger::no_fmt, error::connector::credit_exceeded, ": ", conn->peer);
+            derived().close(conn);
+          }
+          break;
+        }
+        case FrameType::stream_end:
+        {
+          auto it = conn->uploads.find(frame.request_id);
+          if (it == conn->uploads.end()) break;
+          it->second->end();
+          conn->uploads.erase(it);
+          break;
+        }
+        case FrameType::cancel:
+        {
+          // A cancelled upload gets no more items, so that its handler doesn't wait for them.
+          auto it = conn->uploads.find(frame.request_id);
+          if (it != conn->uploads.end())
+          {
+            it->second->end();
+            conn->uploads.erase(it);
+          }
+          if (conn->requests != 0) conn->cancels.add(frame.request_id);
+          break;
+        }
+        case FrameType::hello:
+        {
+          auto answer = answer_hello(admission, frame.content);
+          conn->compress_min = (answer[0] & HELLO_COMPRESS) ? config.compress_min_size : 0;
+          append_frame(derived().outbox(conn), {0, std::move(answer), FrameType::hello});
+          break;
+        }
+        case FrameType::ping:
+          append_frame(derived().outbox(conn), {frame.request_id, std::move(frame.content), FrameType::pong});
+          break;
+        default:
+          break;
+      }
+    }
+    
+    void dispatch(const ConnPtr &conn, Frame &&request)
+    {
+      auto id = request.request_id;
+      auto received = Req::Clock::now();
+      if (admission.admit_request(conn->requests))
+      {
+        bool posted;
+        if (request.type == FrameType::stream_begin)
+        {
+          auto inbox = std::make_shared<Inbox>(
+              [this, weak_conn = std::weak_ptr<Connection>(conn), id](std::size_t bytes)
+              {
+                complete(weak_conn, {id, encode_credit(bytes), FrameType::credit});
+              });
+          posted = executor.try_post([this, conn, id, content = std::move(request.content), inbox, received]
+                                     { handle(conn, id, content, inbox, received); });
+          if (posted) conn->uploads.emplace(id, std::move(inbox));
+        }
+        else
+        {
+          // Small enough to be stored inline, ordinary requests don't allocate.
+          posted = executor.try_post([this, conn, id, content = std::move(request.content), received]
+                                     { handle(conn, id, content, nullptr, received); });
+        }
+        if (posted)
+        {
+          ++conn->requests;
+          return;
+        }
+        admission.queue_full.fetch_add(1, std::memory_order_relaxed);
+      }
+      append_frame(derived().outbox(conn), {id, admission.overloaded});
+    }
+    
+    // Runs on a worker.
+    void handle(const ConnPtr &conn, uint64_t id, const std::string &content, std::shared_ptr<Inbox> inbox,
+                Req::Clock::time_point received)
+    {
+      // Compressed here rather than on the loop, which all connections share.
+      auto write = [this, &conn, id](std::string &&item)
+      {
+        Frame frame{id, std::move(item), FrameType::stream_item};
+        compress_frame(frame, conn->compress_min.load(std::memory_order_relaxed));
+        conn->window.acquire(frame.content.size());
+        complete(conn, std::move(frame));
+      };
+      auto defer = [this, &conn, id]() -> Res::Done
+      {
+        return [self = self, conn, id](std::string &&content)
+        {
+          Frame frame{id, std::move(content)};
+          compress_frame(frame, conn->compress_min.load(std::memory_order_relaxed));
+          self->with([&](auto &loop) { loop.complete(conn, std::move(frame)); });
+        };
+      };
+      auto cancelled = [&conn, id] { return conn->cancels.contains(id); };
+      // std::ref keeps the Writer, the Deferrer and Cancelled from allocating.
+      Res response{std::ref(write), std::ref(defer)};
+      route(router, Req{conn->peer, content, std::move(inbox), received, std::ref(cancelled)}, response, admission);
+      if (response.is_deferred()) return;
+      Frame frame{id, response.get_content()};
+      compress_frame(frame, conn->compress_min.load(std::memory_order_relaxed));
+      complete(conn, std::move(frame));
+    }
+    
+    void sweep_idle()
+    {
+      auto now = std::chrono::steady_clock::now();
+      std::vector<ConnPtr> to_ping;
+      std::vector<ConnPtr> to_close;
+      derived().for_each_connection([&](const ConnPtr &conn)
+      {
+        auto idle = check_idle(conn->last_recv, conn->pinged, conn->requests != 0 || !conn->uploads.empty(),
+                               now, config.idle_timeout);
+        if (idle == Idle::ping) to_ping.emplace_back(conn);
+        else if (idle == Idle::expired) to_close.emplace_back(conn);
+      });
+      // Not while iterating, both may close connections.
+      for (auto &conn: to_ping)
+      {
+        append_frame(derived().outbox(conn), {0, "", FrameType::ping});
+        derived().flush(conn);
+      }
+      for (auto &conn: to_close)
+      {
+        admission.idle_closed.fetch_add(1, std::memory_order_relaxed);
+        derived().close(conn);
+      }
+    }
+    
+    // The part of closing both loops share. Returns false if it was closed already.
+    bool mark_closed(const ConnPtr &conn)
+    {
+      if (conn->closed) return false;
+      conn->closed = true;
+      conn->window.close();
+      for (auto &r: conn->uploads)
+      {
+        r.second->close();
+      }
+      conn->uploads.clear();
+      admission.release_connection();
+      return true;
+    }
+  };
+  
+  struct ReactorConnection : LoopConnection
+  {
+    std::string wbuf;
+    std::size_t wpos;
+    bool want_write;
+#ifdef QWRPC_HAS_SHM
+    // Frames go through its rings instead of the socket, which is only watched for the peer going away.
+    std::unique_ptr<shm::Channel> shm;
+#endif
+    
+    ReactorConnection(Socket &&socket_, std::string peer_, const ServerConfig &config)
+        : LoopConnection(std::move(socket_), std::move(peer_), config), wpos(0), want_write(false) {}
+  };
+  
+  class Reactor : public LoopBase<Reactor, ReactorConnection>
+  {
+  private:
+    friend class LoopBase<Reactor, ReactorConnection>;
+    using Connection = ReactorConnection;
+    
+    int epfd;
+    int evfd;
+    // -1 if connections are handed over by add().
+    int listen_fd;
+    std::atomic<bool> run;
+    // Only touched by the loop thread.
+    std::unordered_map<int, ConnPtr> conns;
+    // Set while listen_fd is out of the epoll set because the process ran out of fds. Loop thread only.
+    std::optional<std::chrono::steady_clock::time_point> accept_resume;
+    // Handed over from other threads, guarded by mtx and signalled through evfd.
+    std::vector<Socket> incoming;
+#ifdef QWRPC_HAS_SHM
+    std::vector<std::pair<Socket, std::unique_ptr<shm::Channel>>> incoming_shm;
+#endif
+    std::thread loop_thread;
+  public:
+    // If `listen_fd_` is given, it must be non-blocking and the loop accepts on it itself.
+    Reactor(const Router &router_, executor::Executor &executor_, Admission &admission_, const ServerConfig &config_,
+            int listen_fd_ = -1)
+        : LoopBase(router_, executor_, admission_, config_), epfd(-1), evfd(-1), listen_fd(listen_fd_), run(true)
+    {
+      epfd = epoll_create1(EPOLL_CLOEXEC);
+      error::qwrpc_assert(epfd != -1, error::connector::epoll_error);
+      evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      error::qwrpc_assert(evfd != -1, error::connector::eventfd_error);
+      for (int fd: {evfd, listen_fd})
+      {
+        if (fd == -1) continue;
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        error::qwrpc_assert(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != -1, error::connector::epoll_error);
+      }
+      loop_thread = std::thread([this] { loop(); });
+    }
+    
+    Reactor(const Reactor &) = delete;
+    
+    ~Reactor()
+    {
+      self->reset();
+      run = false;
+      wakeup();
+      if (loop_thread.joinable()) loop_thread.join();
+      conns.clear();
+      ::close(evfd);
+      ::close(epfd);
+    }
+    
+    // Called by the accept thread.
+    void add(Socket &&socket)
+    {
+      socket.set_nonblocking();
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        incoming.emplace_back(std::move(socket));
+      }
+      wakeup();
+    }
+    
+    void wait()
+    {
+      if (loop_thread.joinable()) loop_thread.join();
+    }
+
+#ifdef QWRPC_HAS_SHM
+    // Called by the shm accept thread after the handshake.
+    void add_shm(Socket &&socket, std::unique_ptr<shm::Channel> &&channel)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        incoming_shm.emplace_back(std::move(socket), std::move(channel));
+      }
+      wakeup();
+    }
+#endif
+  
+  private:
+    void wakeup() const
+    {
+      uint64_t one = 1;
+      [[maybe_unused]] auto ret = ::write(evfd, &one, sizeof(one));
+    }
+    
+    static std::string &outbox(const ConnPtr &conn) { return conn->wbuf; }
+    
+    template<typename F>
+    void for_each_connection(F &&f)
+    {
+      for (auto &[fd, conn]: conns)
+      {
+        // shm connections are also listed under their eventfds.
+        if (fd == conn->socket.get_fd()) f(conn);
+      }
+    }
+    
+    void loop()
+    {
+      std::vector<epoll_event> events(64);
+      int tick = config.idle_timeout.count() == 0 ? -1 : static_cast<int>(idle_tick(config.idle_timeout).count());
+      auto next_sweep = std::chrono::steady_clock::now();
+      while (run)
+      {
+        int timeout = tick;
+        if (accept_resume.has_value())
+        {
+          auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+              *accept_resume - std::chrono::steady_clock::now()).count() + 1;
+          timeout = static_cast<int>(std::max<decltype(left)>(
+              timeout == -1 ? left : std::min<decltype(left)>(timeout, left), 0));
+        }
+        int n = epoll_wait(epfd, events.data(), static_cast<int>(events.size()), timeout);
+        if (accept_resume.has_value() && std::chrono::steady_clock::now() >= *accept_resume)
+        {
+          accept_resume.reset();
+          watch_listener();
+        }
+        if (tick != -1 && std::chrono::steady_clock::now() >= next_sweep)
+        {
+          sweep_idle();
+          next_sweep = std::chrono::steady_clock::now() + std::chrono::milliseconds(tick);
+        }
+        if (n == -1)
+        {
+          if (errno == EINTR) continue;
+          logger::error(logger::no_fmt, error::connector::epoll_error, ": ", std::strerror(errno));
+          return;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+          int fd = events[i].data.fd;
+          if (fd == evfd)
+          {
+            on_wakeup();
+            continue;
+          }
+          if (fd == listen_fd)
+          {
+            on_accept();
+            continue;
+          }
+          auto it = conns.find(fd);
+          if (it == conns.end()) continue;
+          auto conn = it->second;
+#ifdef QWRPC_HAS_SHM
+          if (conn->shm != nullptr)
+          {
+            on_shm_event(conn, fd);
+            continue;
+          }
+#endif
+          if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+          {
+            on_readable(conn);
+          }
+          if (!conn->closed && (events[i].events & EPOLLOUT))
+          {
+            flush(conn);
+          }
+        }
+      }
+    }
+    
+    void on_wakeup()
+    {
+      uint64_t cnt;
+      [[maybe_unused]] auto ret = ::read(evfd, &cnt, sizeof(cnt));
+      std::vector<Socket> new_sockets;
+      std::vector<std::pair<std::weak_ptr<Connection>, Frame>> responses;
+#ifdef QWRPC_HAS_SHM
+      std::vector<std::pair<Socket, std::unique_ptr<shm::Channel>>> new_shm;
+#endif
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        new_sockets.swap(incoming);
+        responses.swap(completed);
+#ifdef QWRPC_HAS_SHM
+        new_shm.swap(incoming_shm);
+#endif
+      }
+#ifdef QWRPC_HAS_SHM
+      for (auto &[socket, channel]: new_shm)
+      {
+        add_shm_connection(std::move(socket), std::move(channel));
+      }
+#endif
+      for (auto &socket: new_sockets)
+      {
+        add_connection(std::move(socket));
+      }
+      for (auto &[weak_conn, response]: responses)
+      {
+        if (auto conn = take_response(weak_conn, response)) flush(conn);
+      }
+    }
+    
+    void watch_listener()
+    {
+      epoll_event ev{};
+      ev.events = EPOLLIN;
+      ev.data.fd = listen_fd;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1)
+      {
+        logger::error(logger::no_fmt, error::connector::epoll_error, ": ", std::strerror(errno));
+      }
+    }
+    
+    void on_accept()
+    {
+      while (true)
+      {
+        int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+          if (errno == EINTR || errno == ECONNABORTED) continue;
+          if (errno != EAGAIN && errno != EWOULDBLOCK)
+          {
+            logger::error(logger::no_fmt, error::connector::socket_accept_error, ": ", std::strerror(errno));
+          }
+          // The listener stays readable while out of fds, so it is left alone for a while instead of
+          // waking the loop again right away.
+          if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+          {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, listen_fd, nullptr);
+            accept_resume = std::chrono::steady_clock::now() + ACCEPT_BACKOFF;
+          }
+          return;
+        }
+        Socket socket{fd};
+        socket.set_nodelay();
+        add_connection(std::move(socket));
+      }
+    }
+    
+    void add_connection(Socket &&socket)
+    {
+      int fd = socket.get_fd();
+      std::string peer;
+      try
+      {
+        peer = socket.get_peer_addr().to_string();
+      }
+      catch (error::Error &)
+      {
+        return;
+      }
+      // Over max_connections it is closed right here, so it holds on to nothing.
+      if (!admission.admit_connection()) return;
+      socket.set_keepalive(config.tcp_keepalive);
+      auto conn = std::make_shared<Connection>(std::move(socket), std::move(peer), config);
+      epoll_event ev{};
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+      {
+        logger::error(logger::no_fmt, error::connector::epoll_error, ": ", std::strerror(errno));
+        admission.release_connection();
+        return;
+      }
+      conns.emplace(fd, std::move(conn));
+    }
+    
+    void on_readable(const ConnPtr &conn)
+    {
+      while (true)
+      {
+        auto want = std::max(RECV_CHUNK, conn->rbuf.missing());
+        auto n = ::recv(conn->socket.get_fd(), conn->rbuf.prepare(want), want, 0);
+        if (n > 0)
+        {
+          conn->rbuf.commit(n);
+          conn->last_recv = std::chrono::steady_clock::now();
+          conn->pinged = false;
+          // Parsed as it comes, so that rbuf never holds more than one incomplete frame.
+          if (!parse_frames(conn)) return;
+          continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        // EOF or error
+        close(conn);
+        return;
+      }
+      // Rejected requests are answered at once.
+      if (!conn->wbuf.empty()) flush(conn);
+    }
+    
+    void flush(const ConnPtr &conn)
+    {
+#ifdef QWRPC_HAS_SHM
+      if (conn->shm != nullptr)
+      {
+        flush_shm(conn);
+        return;
+      }
+#endif
+      while (conn->wpos < conn->wbuf.size())
+      {
+        auto n = ::send(conn->socket.get_fd(), conn->wbuf.data() + conn->wpos,
+                        conn->wbuf.size() - conn->wpos, SEND_FLAGS);
+        if (n >= 0)
+        {
+          conn->wpos += n;
+          conn->window.release(n);
+          continue;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        close(conn);
+        return;
+      }
+      bool want_write = conn->wpos < conn->wbuf.size();
+      if (!want_write)
+      {
+        conn->wbuf.clear();
+        conn->wpos = 0;
+      }
+      else
+      {
+        compact(conn);
+      }
+      if (want_write != conn->want_write)
+      {
+        conn->want_write = want_write;
+        epoll_event ev{};
+        ev.events = want_write ? (EPOLLIN | EPOLLOUT) : static_cast<uint32_t>(EPOLLIN);
+        ev.data.fd = conn->socket.get_fd();
+        epoll_ctl(epfd, EPOLL_CTL_MOD, conn->socket.get_fd(), &ev);
+      }
+    }
+    
+    // A stream keeps appending while the front is being sent, so wbuf may never drain completely.
+    // Drop the sent part before it piles up.
+    static void compact(const ConnPtr &conn)
+    {
+      if (conn->wpos > conn->wbuf.size() / 2)
+      {
+        conn->wbuf.erase(0, conn->wpos);
+        conn->wpos = 0;
+      }
+    }
+    
+    void close(const ConnPtr &conn)
+    {
+      if (!mark_closed(conn)) return;
+      int fd = conn->socket.get_fd();
+      epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+      conns.erase(fd);
+#ifdef QWRPC_HAS_SHM
+      if (conn->shm != nullptr)
+      {
+        for (auto e: {shm::request_data, shm::response_space})
+        {
+          epoll_ctl(epfd, EPOLL_CTL_DEL, conn->shm->fd(e), nullptr);
+          conns.erase(conn->shm->fd(e));
+        }
+      }
+#endif
+    }
+
+#ifdef QWRPC_HAS_SHM
+    // The socket and the two eventfds the client signals all map to the same connection.
+    void add_shm_connection(Socket &&socket, std::unique_ptr<shm::Channel> &&channel)
+    {
+      if (!admission.admit_connection()) return;
+      auto peer = "shm:" + std::to_string(socket.get_fd());
+      auto conn = std::make_shared<Connection>(std::move(socket), std::move(peer), config);
+      conn->shm = std::move(channel);
+      for (int fd: {conn->socket.get_fd(), conn->shm->fd(shm::request_data), conn->shm->fd(shm::response_space)})
+      {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        {
+          logger::error(logger::no_fmt, error::connector::epoll_error, ": ", std::strerror(errno));
+          close(conn);
+          return;
+        }
+        conns.emplace(fd, conn);
+      }
+      // Requests may have been written before the eventfds were watched.
+      on_shm_readable(conn);
+    }
+    
+    void on_shm_event(const ConnPtr &conn, int fd)
+    {
+      if (fd == conn->socket.get_fd())
+      {
+        // The client never writes to the socket after the handshake, so this is EOF.
+        close(conn);
+        return;
+      }
+      shm::Waiter::drain(fd);
+      if (fd == conn->shm->fd(shm::response_space))
+      {
+        flush(conn);
+      }
+      else
+      {
+        on_shm_readable(conn);
+      }
+    }
+    
+    // The client wrote garbage to a ring header.
+    void on_shm_corrupted(const ConnPtr &conn, const error::Error &err)
+    {
+      logger::warn(logger::no_fmt, err.get_detail(), ": ", conn->peer);
+      close(conn);
+    }
+    
+    void on_shm_readable(const ConnPtr &conn)
+    {
+      auto &ring = conn->shm->request();
+      auto hdr = ring.header();
+      // Frames are parsed after every read, so rbuf holds at most one incomplete frame. A client that keeps
+      // writing gets one ring's worth per turn, then the loop signals itself and serves the others first.
+      auto limit = config.max_frame_size + sizeof(Msg);
+      auto budget = ring.get_capacity();
+      try
+      {
+        while (true)
+        {
+          auto n = ring.readable();
+          if (n == 0)
+          {
+            // The loop can't spin, so ask the client for an eventfd signal before going back to epoll.
+            hdr->consumer_waiting.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ring.readable() == 0) break;
+            hdr->consumer_waiting.store(0, std::memory_order_relaxed);
+            continue;
+          }
+          if (budget == 0)
+          {
+            conn->shm->notify(shm::request_data);
+            break;
+          }
+          n = std::min({n, budget, limit - conn->rbuf.size()});
+          ring.read(conn->rbuf.prepare(n), n);
+          conn->rbuf.commit(n);
+          budget -= n;
+          conn->shm->notify_if_waiting(hdr->producer_waiting, shm::request_space);
+          conn->last_recv = std::chrono::steady_clock::now();
+          conn->pinged = false;
+          if (!parse_frames(conn)) return;
+        }
+      }
+      catch (error::Error &err)
+      {
+        on_shm_corrupted(conn, err);
+        return;
+      }
+      if (!conn->wbuf.empty()) flush(conn);
+    }
+    
+    void flush_shm(const ConnPtr &conn)
+    {
+      auto &ring = conn->shm->response();
+      auto hdr = ring.header();
+      try
+      {
+        while (conn->wpos < conn->wbuf.size())
+        {
+          auto n = ring.write(conn->wbuf.data() + conn->wpos, conn->wbuf.size() - conn->wpos);
+          if (n == 0)
+          {
+            // Full, the client signals response_space once it has read something.
+            hdr->producer_waiting.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ring.writable() == 0) break;
+            hdr->producer_waiting.store(0, std::memory_order_relaxed);
+            continue;
+          }
+          conn->wpos += n;
+          conn->window.release(n);
+          conn->shm->notify_if_waiting(hdr->consumer_waiting, shm::response_data);
+        }
+      }
+      catch (error::Error &err)
+      {
+        on_shm_corrupted(conn, err);
+        return;
+      }
+      if (conn->wpos == conn->wbuf.size())
+      {
+        conn->wbuf.clear();
+        conn->wpos = 0;
+      }
+      else
+      {
+        compact(conn);
+      }
+    }
+#endif
+  };
+#endif
+
+#ifdef QWRPC_HAS_IO_URING
+  // An io_uring loop. Every loop has its own multishot accept on the shared listening socket,
+  // receives into registered buffers and submits all requests of one iteration in one io_uring_enter().
+  struct UringConnection : LoopConnection
+  {
+    uint64_t id;
+    // `wbuf` is owned by the kernel while a send is in flight, new frames go to `queued`.
+    std::string wbuf;
+    std::size_t wpos;
+    std::string queued;
+    // Index of the registered buffer, -1 if all of them are taken.
+    int slot;
+    int in_flight;
+    
+    UringConnection(Socket &&socket_, std::string peer_, uint64_t id_, int slot_, const ServerConfig &config)
+        : LoopConnection(std::move(socket_), std::move(peer_), config), id(id_), wpos(0), slot(slot_),
+          in_flight(0) {}
+  };
+  
+  class UringReactor : public LoopBase<UringReactor, UringConnection>
+  {
+  private:
+    friend class LoopBase<UringReactor, UringConnection>;
+    
+    enum Op : uint64_t
+    {
+      op_accept, op_wakeup, op_recv, op_send, op_timer, op_accept_retry
+    };
+    
+    using Connection = UringConnection;
+    
+    int listen_fd;
+    int evfd;
+    uint64_t evbuf;
+    // Read by the kernel while the idle timer is armed.
+    __kernel_timespec tick;
+    // Read by the kernel while accepting waits for fds to be closed.
+    __kernel_timespec accept_delay;
+    std::atomic<bool> run;
+    // Cleared if the kernel is too old for multishot accept, then every accept is armed again.
+    bool multishot;
+    uint64_t next_id;
+    std::vector<char> buffers;
+    std::vector<int> free_slots;
+    // Only touched by the loop thread.
+    std::unordered_map<uint64_t, ConnPtr> conns;
+    std::thread loop_thread;
+    // Declared last, so that it is closed, and all requests referring to the buffers above are gone, first.
+    uring::Uring ring;
+  public:
+    UringReactor(int listen_fd_, const Router &router_, executor::Executor &executor_, Admission &admission_,
+                 const ServerConfig &config_)
+        : LoopBase(router_, executor_, admission_, config_), listen_fd(listen_fd_), evfd(-1), evbuf(0), tick{},
+          accept_delay{0, std::chrono::nanoseconds(ACCEPT_BACKOFF).count()}, run(true), multishot(true), next_id(0), buffers(config_.uring_buffers * RECV_CHUNK),
+          ring(config_.uring_entries)
+    {
+      evfd = eventfd(0, EFD_CLOEXEC);
+      error::qwrpc_assert(evfd != -1, error::connector::eventfd_error);
+      if (!buffers.empty())
+      {
+        std::vector<iovec> iovs(config.uring_buffers);
+        for (std::size_t i = 0; i < iovs.size(); ++i)
+        {
+          iovs[i].iov_base = buffers.data() + i * RECV_CHUNK;
+          iovs[i].iov_len = RECV_CHUNK;
+          free_slots.emplace_back(static_cast<int>(iovs.size() - i - 1));
+        }
+        ring.register_buffers(iovs);
+      }
+      arm_accept();
+      arm_wakeup();
+      if (config.idle_timeout.count() != 0)
+      {
+        auto ms = idle_tick(config.idle_timeout).count();
+        tick.tv_sec = ms / 1000;
+        tick.tv_nsec = ms % 1000 * 1000000;
+        arm_timer();
+      }
+      loop_thread = std::thread([this] { loop(); });
+    }
+    
+    UringReactor(const UringReactor &) = delete;
+    
+    ~UringReactor()
+    {
+      self->reset();
+      run = false;
+      wakeup();
+      if (loop_thread.joinable()) loop_thread.join();
+      ::close(evfd);
+    }
+    
+    void wait()
+    {
+      if (loop_thread.joinable()) loop_thread.join();
+    }
+  
+  private:
+    static uint64_t make_user_data(uint64_t id, Op op) { return (id << 3) | op; }
+    
+    void wakeup() const
+    {
+      uint64_t one = 1;
+      [[maybe_unused]] auto ret = ::write(evfd, &one, sizeof(one));
+    }
+    
+    static std::string &outbox(const ConnPtr &conn) { return conn->queued; }
+    
+    template<typename F>
+    void for_each_connection(F &&f)
+    {
+      for (auto &[id, conn]: conns)
+      {
+        if (!conn->closed) f(conn);
+      }
+    }
+    
+    void arm_accept()
+    {
+      auto sqe = ring.get_sqe();
+      uring::Uring::prep_rw(sqe, IORING_OP_ACCEPT, listen_fd, nullptr, 0, 0, make_user_data(0, op_accept));
+      if (multishot) sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+    }
+    
+    void arm_wakeup()
+    {
+      uring::Uring::prep_rw(ring.get_sqe(), IORING_OP_READ, evfd, &evbuf, sizeof(evbuf), 0,
+                            make_user_data(0, op_wakeup));
+    }
+    
+    void arm_timer()
+    {
+      uring::Uring::prep_rw(ring.get_sqe(), IORING_OP_TIMEOUT, -1, &tick, 1, 0, make_user_data(0, op_timer));
+    }
+    
+    void arm_recv(const ConnPtr &conn)
+    {
+      auto sqe = ring.get_sqe();
+      auto data = make_user_data(conn->id, op_recv);
+      if (conn->slot >= 0)
+      {
+        uring::Uring::prep_rw(sqe, IORING_OP_READ_FIXED, conn->socket.get_fd(),
+                              buffers.data() + conn->slot * RECV_CHUNK, RECV_CHUNK, 0, data);
+        sqe->buf_index = static_cast<uint16_t>(conn->slot);
+      }
+      else
+      {
+        auto want = std::max(RECV_CHUNK, conn->rbuf.missing());
+        uring::Uring::prep_rw(sqe, IORING_OP_RECV, conn->socket.get_fd(), conn->rbuf.prepare(want),
+                              static_cast<unsigned>(want), 0, data);
+      }
+      ++conn->in_flight;
+    }
+    
+    void arm_send(const ConnPtr &conn)
+    {
+      auto sqe = ring.get_sqe();
+      uring::Uring::prep_rw(sqe, IORING_OP_SEND, conn->socket.get_fd(), conn->wbuf.data() + conn->wpos,
+                            static_cast<unsigned>(std::min<std::size_t>(conn->wbuf.size() - conn->wpos, 1u << 30)),
+                            0, make_user_data(conn->id, op_send));
+      sqe->msg_flags = SEND_FLAGS;
+      ++conn->in_flight;
+    }
+    
+    void loop()
+    {
+      while (run)
+      {
+        try
+        {
+          ring.submit(1);
+        }
+        catch (error::Error &err)
+        {
+          logger::error(logger::no_fmt, err.get_detail(), ": ", std::strerror(errno));
+          return;
+        }
+        ring.for_each_cqe([this](const io_uring_cqe &cqe) { on_cqe(cqe); });
+      }
+    }
+    
+    void on_cqe(const io_uring_cqe &cqe)
+    {
+      auto op = static_cast<Op>(cqe.user_data & 7);
+      auto id = cqe.user_data >> 3;
+      if (op == op_accept)
+      {
+        on_accept(cqe);
+        return;
+      }
+      if (op == op_wakeup)
+      {
+        on_wakeup();
+        return;
+      }
+      if (op == op_timer)
+      {
+        if (!run) return;
+        arm_timer();
+        sweep_idle();
+        return;
+      }
+      if (op == op_accept_retry)
+      {
+        if (run) arm_accept();
+        return;
+      }
+      auto it = conns.find(id);
+      if (it == conns.end()) return;
+      auto conn = it->second;
+      --conn->in_flight;
+      if (op == op_recv)
+      {
+        on_recv(conn, cqe.res);
+      }
+      else
+      {
+        on_send(conn, cqe.res);
+      }
+      if (conn->closed && conn->in_flight == 0)
+      {
+        release(conn);
+      }
+    }
+    
+    void on_accept(const io_uring_cqe &cqe)
+    {
+      if (cqe.res < 0)
+      {
+        auto err = -cqe.res;
+        if (multishot && (err == EINVAL || err == EOPNOTSUPP))
+        {
+          multishot = false;
+          logger::warn(logger::no_fmt, "Multishot accept unavailable, accepting one connection at a time.");
+          if (run) arm_accept();
+          return;
+        }
+        if (err == EINTR || err == EAGAIN || err == ECONNABORTED)
+        {
+          if (!(cqe.flags & IORING_CQE_F_MORE) && run) arm_accept();
+          return;
+        }
+        // Out of fds, accepting again right away would only fail the same way until some are closed.
+        if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM)
+        {
+          logger::error(logger::no_fmt, error::connector::socket_accept_error, ": ", std::strerror(err));
+          if (!(cqe.flags & IORING_CQE_F_MORE) && run)
+          {
+            uring::Uring::prep_rw(ring.get_sqe(), IORING_OP_TIMEOUT, -1, &accept_delay, 1, 0,
+                                  make_user_data(0, op_accept_retry));
+          }
+          return;
+        }
+        // The listening socket itself failed, armed again it would only fail the same way.
+        if (err != ECANCELED)
+        {
+          logger::error(logger::no_fmt, error::connector::socket_accept_error, ": ", std::strerror(err));
+        }
+        return;
+      }
+      if (!(cqe.flags & IORING_CQE_F_MORE) && run)
+      {
+        arm_accept();
+      }
+      Socket socket{cqe.res};
+      socket.set_nodelay();
+      socket.set_keepalive(config.tcp_keepalive);
+      std::string peer;
+      try
+      {
+        peer = socket.get_peer_addr().to_string();
+      }
+      catch (error::Error &)
+      {
+        return;
+      }
+      // Over max_connections it is closed right here, before it takes a buffer.
+      if (!admission.admit_connection()) return;
+      int slot = -1;
+      if (!free_slots.empty())
+      {
+        slot = free_slots.back();
+        free_slots.pop_back();
+      }
+      auto conn = std::make_shared<Connection>(std::move(socket), std::move(peer), ++next_id, slot, config);
+      conns.emplace(conn->id, conn);
+      arm_recv(conn);
+    }
+    
+    void on_wakeup()
+    {
+      if (!run) return;
+      arm_wakeup();
+      std::vector<std::pair<std::weak_ptr<Connection>, Frame>> responses;
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        responses.swap(completed);
+      }
+      std::vector<ConnPtr> touched;
+      for (auto &[weak_conn, response]: responses)
+      {
+        if (auto conn = take_response(weak_conn, response)) touched.emplace_back(std::move(conn));
+      }
+      // One send per connection carries every response completed since the last wakeup.
+      for (auto &conn: touched)
+      {
+        if (!conn->closed) flush(conn);
+      }
+    }
+    
+    // Sends what is queued unless a send is in flight already, on_send() picks it up then.
+    void flush(const ConnPtr &conn)
+    {
+      if (conn->queued.empty() || conn->wpos < conn->wbuf.size()) return;
+      conn->wbuf.clear();
+      conn->wpos = 0;
+      conn->wbuf.swap(conn->queued);
+      arm_send(conn);
+    }
+    
+    void on_recv(const ConnPtr &conn, int res)
+    {
+      if (res <= 0)
+      {
+        close(conn);
+        return;
+      }
+      if (conn->closed) return;
+      if (conn->slot >= 0)
+      {
+        std::memcpy(conn->rbuf.prepare(res), buffers.data() + conn->slot * RECV_CHUNK, res);
+      }
+      conn->rbuf.commit(res);
+      conn->last_recv = std::chrono::steady_clock::now();
+      conn->pinged = false;
+      if (!parse_frames(conn)) return;
+      // Rejected requests are answered at once.
+      flush(conn);
+      arm_recv(conn);
+    }
+    
+    void on_send(const ConnPtr &conn, int res)
+    {
+      if (res < 0)
+      {
+        close(conn);
+        return;
+      }
+      if (conn->closed) return;
+      conn->wpos += res;
+      conn->window.release(res);
+      if (conn->wpos < conn->wbuf.size())
+      {
+        arm_send(conn);
+        return;
+      }
+      conn->wbuf.clear();
+      conn->wpos = 0;
+      if (!conn->queued.empty())
+      {
+        conn->wbuf.swap(conn->queued);
+        arm_send(conn);
+      }
+    }
+    
+    void close(const ConnPtr &conn)
+    {
+      if (!mark_closed(conn)) return;
+      // Requests still in flight complete with an error after the shutdown, the connection is released then.
+      ::shutdown(conn->socket.get_fd(), SHUT_RDWR);
+      if (conn->in_flight == 0)
+      {
+        release(conn);
+      }
+    }
+    
+    void release(const ConnPtr &conn)
+    {
+      if (conn->slot >= 0)
+      {
+        free_slots.emplace_back(conn->slot);
+        conn->slot = -1;
+      }
+      conns.erase(conn->id);
+    }
+  };
+#endif
+  
+  class Server
+  {
+  private:
+    Addr addr;
+    bool running;
+    Router router;
+    ServerConfig config;
+    Admission admission;
+    // One per shard, closed after the loops accepting on them are gone.
+    std::vector<Socket> listeners;
+#ifdef __linux__
+    // Declared before pools, so that the workers are joined before the loops they report to go away.
+    std::vector<std::unique_ptr<Reactor>> reactors;
+#endif
+#ifdef QWRPC_HAS_IO_URING
+    std::vector<std::unique_ptr<UringReactor>> uring_reactors;
+#endif
+    // One per shard.
+    std::vector<std::unique_ptr<executor::Executor>> pools;
+#ifdef QWRPC_HAS_SHM
+    Socket shm_socket;
+    std::thread shm_acceptor;
+#endif
+  public:
+    Server(const Addr &addr_, const Router &router_, const ServerConfig &config_ = {})
+        : addr(addr_), running(false), router(router_), config(config_), admission(config)
+#ifdef QWRPC_HAS_SHM
+        , shm_socket(-1)
+#endif
+    {}
+    
+    Server(int p, const Router &router_, const ServerConfig &config_ = {})
+        : Server(Addr{p}, router_, config_) {}
+    
+    Server(const Server &) = delete;
+    
+    ~Server()
+    {
+#ifdef QWRPC_HAS_SHM
+      if (shm_acceptor.joinable())
+      {
+        running = false;
+        ::shutdown(shm_socket.get_fd(), SHUT_RDWR);
+        shm_acceptor.join();
+      }
+#endif
+    }
+    
+    // What requests rejected by a limit of ServerConfig get back. Set it before start().
+    void set_overloaded_response(const std::string &content) { admission.overloaded = content; }
+    
+    // What a request gets back if the router throws. Set it before start().
+    void set_failed_response(const std::string &content) { admission.failed = content; }
+    
+    // What clients asking with HELLO_METHODS get with the answer to their hello. Set it before start().
+    void set_method_table(const std::string &table) { admission.method_table = table; }
+    
+    ServerStats get_stats() const { return admission.stats(); }
+    
+    void start()
+    {
+      running = true;
+      auto shards = sharded() ? config.shards : 1;
+      for (std::size_t i = 0; i < shards; ++i)
+      {
+        Socket socket(addr);
+#ifdef SO_REUSEPORT
+        if (shards > 1) socket.set_reuseport();
+#endif
+        socket.bind(addr);
+        socket.listen(config.backlog);
+        listeners.emplace_back(std::move(socket));
+        auto max_queued = config.max_queued == 0 ? 0 : std::max<std::size_t>(config.max_queued / shards, 1);
+        pools.emplace_back(std::make_unique<executor::Executor>(std::max<std::size_t>(config.workers / shards, 1),
+                                                                max_queued));
+      }
+      auto loops = shards > 1 ? shards : std::max<std::size_t>(config.io_threads, 1);
+#ifdef QWRPC_HAS_IO_URING
+      if (config.mode == ServerMode::io_uring)
+      {
+        try
+        {
+          for (std::size_t i = 0; i < loops; ++i)
+          {
+            uring_reactors.emplace_back(std::make_unique<UringReactor>(listeners[i % shards].get_fd(), router,
+                                                                       *pools[i % shards], admission, config));
+          }
+          uring_reactors[0]->wait();
+          return;
+        }
+        catch (error::Error &err)
+        {
+          logger::warn(logger::no_fmt, err.get_detail(), ", falling back to epoll.");
+          uring_reactors.clear();
+        }
+      }
+#endif
+#ifdef __linux__
+      if (config.mode == ServerMode::reactor || config.mode == ServerMode::io_uring)
+      {
+        for (std::size_t i = 0; i < loops; ++i)
+        {
+          int listen_fd = -1;
+          if (shards > 1)
+          {
+            listeners[i].set_nonblocking();
+            listen_fd = listeners[i].get_fd();
+          }
+          reactors.emplace_back(std::make_unique<Reactor>(router, *pools[i % shards], admission, config,
+                                                              listen_fd));
+        }
+#ifdef QWRPC_HAS_SHM
+        if (!config.shm_path.empty())
+        {
+          auto shm_addr = Addr::unix_socket(config.shm_path);
+          shm_socket = Socket(shm_addr);
+          shm_socket.bind(shm_addr);
+          shm_socket.listen();
+          shm_acceptor = std::thread([this] { accept_shm(); });
+        }
+#endif
+        if (shards > 1)
+        {
+          reactors[0]->wait();
+          return;
+        }
+        std::size_t next = 0;
+        while (running)
+        {
+          auto tmp = listeners[0].accept();
+          if (std::get<0>(tmp).get_fd() == -1)
+          {
+            on_accept_error();
+            continue;
+          }
+          reactors[next]->add(std::move(std::get<0>(tmp)));
+          next = (next + 1) % reactors.size();
+        }
+        return;
+      }
+#endif
+      while (running)
+      {
+        auto tmp = listeners[0].accept();
+        auto&[clnt_socket, clnt_addr] = tmp;
+        if (clnt_socket.get_fd() == -1)
+        {
+          on_accept_error();
+          continue;
+        }
+        // A rejected connection is closed when `tmp` goes away.
+        if (!admission.admit_connection()) continue;
+        auto posted = pools[0]->try_post(
+            [this, clnt_socket = std::move(std::get<0>(tmp))]
+            {
+              FrameBuffer buf(config.max_frame_size, config.max_message_size);
+              // Calls that arrived while a handler was reading its items, at most about STREAM_WINDOW bytes.
+              std::deque<Frame> later;
+              std::size_t later_bytes = 0;
+              std::size_t compress_min = 0;
+              // Answers pings, and pings a client that has been silent for half of idle_timeout.
+              auto next = [this, &clnt_socket, &buf]
+              {
+                Frame frame;
+                bool pinged = false;
+                while (true)
+                {
+                  if (!clnt_socket.recv(buf, frame))
+                  {
+                    if (pinged)
+                    {
+                      admission.idle_closed.fetch_add(1, std::memory_order_relaxed);
+                      throw error::Error(error::connector::idle_timeout);
+                    }
+                    clnt_socket.send("", 0, FrameType::ping);
+                    pinged = true;
+                    continue;
+                  }
+                  if (frame.type != FrameType::ping) return frame;
+                  clnt_socket.send(frame.content, frame.request_id, FrameType::pong);
+                }
+              };
+              try
+              {
+                clnt_socket.set_keepalive(config.tcp_keepalive);
+                if (config.idle_timeout.count() != 0) clnt_socket.set_recv_timeout(config.idle_timeout / 2);
+                while (true)
+                {
+                  Frame request;
+                  if (later.empty())
+                  {
+                    request = next();
+                  }
+                  else
+                  {
+                    request = std::move(later.front());
+                    later.pop_front();
+                    later_bytes -= request.content.size();
+                  }
+                  if (request.content == "quit")
+                  {
+                    break;
+                  }
+                  if (request.type == FrameType::hello)
+                  {
+                    auto answer = answer_hello(admission, request.content);
+                    compress_min = (answer[0] & HELLO_COMPRESS) ? config.compress_min_size : 0;
+                    clnt_socket.send(answer, 0, FrameType::hello);
+                    continue;
+                  }
+                  // Leftover items of a call that has already been answered. Cancels too, calls are handled
+                  // one at a time here, so the call has been answered by the time they are read.
+                  if (request.type != FrameType::message && request.type != FrameType::stream_begin) continue;
+                  auto id = request.request_id;
+                  std::shared_ptr<Inbox> inbox;
+                  if (request.type == FrameType::stream_begin)
+                  {
+                    // Nobody else reads the socket, so the handler pulls its items itself.
+                    inbox = std::make_shared<Inbox>(
+                        [&clnt_socket, id](std::size_t bytes)
+                        {
+                          clnt_socket.send(encode_credit(bytes), id, FrameType::credit);
+                        },
+                        [this, &clnt_socket, &next, &later, &later_bytes, &inbox, id]
+                        {
+                          auto frame = next();
+                          if (frame.request_id == id && frame.type == FrameType::stream_item)
+                          {
+                            error::qwrpc_assert(inbox->push(std::move(frame.content)),
+                                                error::connector::credit_exceeded);
+                          }
+                          else if (frame.request_id == id && frame.type == FrameType::stream_end)
+                          {
+                            inbox->end();
+                          }
+                          else if (frame.type == FrameType::stream_begin
+                                   || (frame.type == FrameType::message && frame.content != "quit"
+                                       && later_bytes >= STREAM_WINDOW))
+                          {
+                            // Only one upload is read at a time, and only so many calls wait for it.
+                            admission.too_many_in_flight.fetch_add(1, std::memory_order_relaxed);
+                            clnt_socket.send(admission.overloaded, frame.request_id);
+                          }
+                          else if (frame.type == FrameType::message || frame.type == FrameType::hello)
+                          {
+                            later_bytes += frame.content.size();
+                            later.emplace_back(std::move(frame));
+                          }
+                          // Anything else belongs to calls that have been answered already.
+                        });
+                  }
+                  // Items go out right away, a slow client blocks the handler in send().
+                  auto write = [&clnt_socket, id, compress_min](std::string &&item)
+                  {
+                    Frame frame{id, std::move(item), FrameType::stream_item};
+                    compress_frame(frame, compress_min);
+                    clnt_socket.send(frame);
+                  };
+                  // The connection has this worker anyway, so a deferred response is waited for here.
+                  // Only the Done holds the promise, so dropping it uncalled breaks the promise instead of
+                  // leaving this worker waiting.
+                  std::future<std::string> deferred;
+                  auto defer = [&deferred]() -> Res::Done
+                  {
+                    auto promise = std::make_shared<std::promise<std::string>>();
+                    deferred = promise->get_future();
+                    return [promise](std::string &&content) { promise->set_value(std::move(content)); };
+                  };
+                  Res response{std::ref(write), std::ref(defer)};
+                  route(router, Req{clnt_socket.get_peer_addr().to_string(), request.content, inbox}, response,
+                        admission);
+                  Frame frame{id, response.get_content()};
+                  if (response.is_deferred())
+                  {
+                    try
+                    {
+                      frame.content = deferred.get();
+                    }
+                    catch (std::future_error &)
+                    {
+                      logger::error(logger::no_fmt, "Deferred response dropped without being sent.");
+                      frame.content = admission.failed;
+                    }
+                  }
+                  compress_frame(frame, compress_min);
+                  clnt_socket.send(frame);
+                }
+              }
+              // Nobody waits for a posted task, so it must not throw.
+              catch (std::exception &err)
+              {
+                logger::warn(logger::no_fmt, "Connection closed: ", err.what());
+              }
+              catch (...)
+              {
+                logger::warn(logger::no_fmt, "Connection closed: unknown exception");
+              }
+              admission.release_connection();
+            });
+        if (!posted)
+        {
+          admission.queue_full.fetch_add(1, std::memory_order_relaxed);
+          admission.release_connection();
+        }
+      }
+    }
+  
+  private:
+    bool sharded() const
+    {
+#if defined(__linux__) && defined(SO_REUSEPORT)
+      return config.shards > 1 && config.mode != ServerMode::thread_per_connection && addr.family() == AF_INET;
+#else
+      return false;
+#endif
+    }
+
+    // A failed accept() doesn't stop the server. Out of fds, it waits a little for some to be closed
+    // instead of failing again right away.
+    static void on_accept_error()
+    {
+      int err = errno;
+      if (err == EINTR || err == ECONNABORTED) return;
+      logger::error(logger::no_fmt, error::connector::socket_accept_error, ": ", std::strerror(err));
+      if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM)
+      {
+        std::this_thread::sleep_for(ACCEPT_BACKOFF);
+      }
+    }
+
+#ifdef QWRPC_HAS_SHM
+    void accept_shm()
+    {
+      std::size_t next = 0;
+      while (running)
+      {
+        auto [clnt_socket, clnt_addr] = shm_socket.accept();
+        if (clnt_socket.get_fd() == -1)
+        {
+          if (errno == EINTR || errno == ECONNABORTED) continue;
+          return;
+        }
+        // Don't let a client that never sends its fds stall the other handshakes.
+        timeval tv{.tv_sec = 1, .tv_usec = 0};
+        setsockopt(clnt_socket.get_fd(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        try
+        {
+          auto channel = shm::Channel::receive_from(clnt_socket.get_fd());
+          reactors[next]->add_shm(std::move(clnt_socket), std::move(channel));
+          next = (next + 1) % reactors.size();
+        }
+        catch (error::Error &err)
+        {
+          logger::warn(logger::no_fmt, err.get_detail());
+        }
+      }
+    }
+#endif
+  };
+  
+  enum class ClientMode
+  {
+    // A reader thread blocks in recv(), callers send() themselves.
+    reader_thread,
+    // An io_uring loop receives, and sends the frames of all callers queued since its last send in one go.
+    // Falls back to reader_thread if io_uring is unavailable.
+    io_uring,
+    // Frames go through a pair of rings in shared memory, connect to the ServerConfig::shm_path of a server
+    // on the same host. Linux only.
+    shared_memory
+  };
+  
+  // Wakes Clients when their earliest call deadline passes. One thread serves all the Clients of the
+  // process and starts with the first deadline, so a ClientPool doesn't cost a thread per connection.
+  class DeadlineTimer
+  {
+  public:
+    using Clock = std::chrono::steady_clock;
+    // Runs on the timer thread, returns when the owner wants to be woken next, if at all.
+    using Expire = std::function<std::optional<Clock::time_point>()>;
+  private:
+    std::mutex mtx;
+    std::condition_variable cond;
+    // Notified whenever an owner's Expire has returned.
+    std::condition_variable fired;
+    std::multimap<Clock::time_point, const void *> queue;
+    std::unordered_map<const void *, std::pair<decltype(queue)::iterator, Expire>> owners;
+    // Whose Expire runs right now, and whether it was removed meanwhile from that very call.
+    const void *firing;
+    bool firing_removed;
+    bool stop;
+    std::thread thread;
+  public:
+    DeadlineTimer() : firing(nullptr), firing_removed(false), stop(false) {}
+    
+    DeadlineTimer(const DeadlineTimer &) = delete;
+    
+    ~DeadlineTimer()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+      }
+      cond.notify_one();
+      if (thread.joinable()) thread.join();
+    }
+    
+    static DeadlineTimer &get()
+    {
+      static DeadlineTimer timer;
+      return timer;
+    }
+    
+    // Calls `expire` at `at`, or earlier if `owner` is due earlier already. `expire` is kept until
+    // it returns nothing.
+    void schedule(const void *owner, Clock::time_point at, Expire expire)
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (!thread.joinable()) thread = std::thread([this] { loop(); });
+      if (insert(owner, at, std::move(expire))) cond.notify_one();
+    }
+    
+    // After it returns, `owner`'s Expire isn't running and won't run again.
+    void remove(const void *owner)
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      if (std::this_thread::get_id() == thread.get_id())
+      {
+        // Its own Expire destroys it, the loop mustn't schedule it again.
+        if (firing == owner) firing_removed = true;
+      }
+      else
+      {
+        fired.wait(lock, [this, owner] { return firing != owner; });
+      }
+      auto it = owners.find(owner);
+      if (it == owners.end()) return;
+      queue.erase(it->second.first);
+      owners.erase(it);
+    }
+  
+  private:
+    // Returns whether the owner is due first now. Called with mtx held.
+    bool insert(const void *owner, Clock::time_point at, Expire &&expire)
+    {
+      auto it = owners.find(owner);
+      if (it == owners.end())
+      {
+        auto pos = queue.emplace(at, owner);
+        owners.emplace(owner, std::make_pair(pos, std::move(expire)));
+        return pos == queue.begin();
+      }
+      if (it->second.first->first <= at) return false;
+      queue.erase(it->second.first);
+      it->second.first = queue.emplace(at, owner);
+      return it->second.first == queue.begin();
+    }
+    
+    void loop()
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      while (!stop)
+      {
+        if (queue.empty())
+        {
+          cond.wait(lock);
+          continue;
+        }
+        auto first = queue.begin();
+        if (Clock::now() < first->first)
+        {
+          cond.wait_until(lock, first->first);
+          continue;
+        }
+        auto owner = first->second;
+        auto it = owners.find(owner);
+        auto expire = std::move(it->second.second);
+        owners.erase(it);
+        queue.erase(first);
+        firing = owner;
+        firing_removed = false;
+        lock.unlock();
+        auto next = expire();
+        lock.lock();
+        if (next.has_value() && !firing_removed) insert(owner, *next, std::move(expire));
+        firing = nullptr;
+        fired.notify_all();
+      }
+    }
+  };
+  
+  struct ClientConfig
+  {
+    // Only used by ClientPool.
+    std::size_t connections = 1;
+    // Only used by ClientPool: a connection that failed to reconnect isn't tried again for this long,
+    // doubling with every further failure up to 64 times as long.
+    std::chrono::milliseconds reconnect_backoff{100};
+    ClientMode mode = ClientMode::reader_thread;
+    // shared_memory only: bytes of each ring.
+    std::size_t shm_capacity = 1 << 20;
+    // Like in ServerConfig, responses over them break the connection.
+    std::size_t max_frame_size = MAX_FRAME_SIZE;
+    std::size_t max_message_size = MAX_MESSAGE_SIZE;
+    // Not shared_memory: asks the server to compress messages of at least compress_min_size bytes,
+    // in both directions. Worth it on slow links, not on loopback.
+    bool compression = false;
+    std::size_t compress_min_size = 1024;
+    // Asks the server for the binary envelope, which is much cheaper to parse than czh. Calls go out as czh
+    // until the server agreed, and with servers that don't know it.
+    bool binary_envelope = true;
+    // Asks the server for its method table, calls then carry the number of their method instead of its name.
+    // Only with binary_envelope.
+    bool method_ids = true;
+    // Deadline of every call of RpcClient but the streaming ones, 0 means none. The server gets it too,
+    // and skips or cancels calls whose caller has given up.
+    std::chrono::milliseconds timeout{0};
+    // Not shared_memory: a connection that received nothing for this long pings the server, and breaks
+    // if nothing arrives for as long again. ClientPool replaces broken connections. 0 turns it off.
+    std::chrono::milliseconds keepalive{0};
+    // TCP keepalive probes after this much silence, 0 leaves them off.
+    std::chrono::seconds tcp_keepalive{0};
+  };
+  
+  class Client
+  {
+  public:
+    // Called on the reader thread with the response, or with the error that broke the connection.
+    using Callback = std::function<void(std::string &&, std::exception_ptr)>;
+    // Called on the reader thread with every item of a streaming response, before the Callback gets
+    // the rest. Must not throw.
+    using ItemCallback = std::function<void(std::string &&)>;
+  private:
+    ClientConfig config;
+    Socket socket;
+    FrameBuffer rbuf;
+    std::mutex send_mtx;
+    std::mutex pending_mtx;
+    std::unordered_map<uint64_t, Callback> pending;
+    // Also guarded by pending_mtx, but only erased from on the reader thread, so that it can call them unlocked.
+    std::unordered_map<uint64_t, ItemCallback> streams;
+    struct Upload
+    {
+      std::mutex mtx;
+      std::condition_variable cond;
+      // Bytes the server still takes, the last item may take it below 0.
+      int64_t credit = STREAM_WINDOW;
+      bool done = false;
+    };
+    // Client-streaming calls by request id, guarded by pending_mtx.
+    std::unordered_map<uint64_t, std::shared_ptr<Upload>> uploads;
+    // Calls sent with async_send_until(), cancelled on the DeadlineTimer once their deadline passes.
+    // Guarded by pending_mtx.
+    std::multimap<std::chrono::steady_clock::time_point, uint64_t> deadlines;
+    std::unordered_map<uint64_t, decltype(deadlines)::iterator> deadline_of;
+    // Whether this has been given to the DeadlineTimer. Guarded by pending_mtx.
+    bool timed;
+    // Calls the DeadlineTimer found past their deadline, cancelled by the reader thread or loop, so that
+    // neither callbacks nor cancel frames run on the timer thread all Clients share. Guarded by pending_mtx.
+    std::vector<uint64_t> expired;
+    std::atomic<bool> expired_pending;
+    std::atomic<uint64_t> next_id;
+    std::atomic<std::size_t> in_flight;
+    // Set once the server agreed to compression in its hello, 0 until then.
+    std::atomic<std::size_t> compress_min;
+    // Set once the server agreed to the binary envelope in its hello.
+    std::atomic<bool> binary;
+    // The method table that came with the server's hello, and what the layer above decoded from it.
+    // Guarded by table_mtx.
+    std::shared_ptr<const std::string> method_table;
+    std::shared_ptr<const void> decoded_table;
+    mutable std::mutex table_mtx;
+    std::atomic<bool> broken;
+    // Why the connection broke, handed to calls made afterwards. Guarded by pending_mtx.
+    std::exception_ptr broken_by;
+    std::atomic<bool> stopping;
+    std::thread reader;
+#ifdef QWRPC_HAS_IO_URING
+    // Written by the kernel, so they must outlive `ring` even if the loop has stopped with requests pending.
+    std::vector<char> uring_buf;
+    uint64_t evbuf;
+    __kernel_timespec tick;
+    std::unique_ptr<uring::Uring> ring;
+    int evfd;
+    // Frames waiting for the loop, guarded by send_mtx.
+    std::string outbox;
+    std::atomic<bool> wake_pending;
+#endif
+#ifdef QWRPC_HAS_SHM
+    std::unique_ptr<shm::Channel> shm;
+    // Guarded by send_mtx.
+    shm::Waiter send_waiter;
+#endif
+#ifdef __linux__
+    // Wakes read_loop() for `expired`.
+    int wake_fd;
+#endif
+  public:
+    explicit Client(const ClientConfig &config_ = {})
+        : config(config_), rbuf(config.max_frame_size, config.max_message_size),
+          timed(false), expired_pending(false), next_id(1), in_flight(0), compress_min(0), binary(false), broken(false), stopping(false)
+#ifdef QWRPC_HAS_IO_URING
+        , evbuf(0), tick{}, evfd(-1), wake_pending(false)
+#endif
+#ifdef __linux__
+        , wake_fd(-1)
+#endif
+    {}
+    
+    Client(const Client &) = delete;
+    
+    ~Client()
+    {
+      bool was_timed;
+      {
+        std::lock_guard<std::mutex> lock(pending_mtx);
+        was_timed = timed;
+      }
+      if (was_timed) DeadlineTimer::get().remove(this);
+      if (!reader.joinable()) return;
+#ifdef QWRPC_HAS_IO_URING
+      if (ring != nullptr)
+      {
+        {
+          std::lock_guard<std::mutex> lock(send_mtx);
+          append_frame(outbox, {0, "quit"});
+        }
+        stopping = true;
+        wakeup();
+        reader.join();
+        ::shutdown(socket.get_fd(), 2);
+        ::close(evfd);
+        fail_all(std::make_exception_ptr(error::Error(error::connector::socket_broken)));
+        return;
+      }
+#endif
+#ifdef QWRPC_HAS_SHM
+      if (shm != nullptr)
+      {
+        try
+        {
+          std::lock_guard<std::mutex> lock(send_mtx);
+          shm_send("quit", 4, 0);
+        }
+        catch (error::Error &) {}
+        stopping = true;
+        shm->notify(shm::response_data);
+        reader.join();
+        ::shutdown(socket.get_fd(), 2);
+        fail_all(std::make_exception_ptr(error::Error(error::connector::socket_broken)));
+        return;
+      }
+#endif
+      try
+      {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        socket.send("quit");
+      }
+      catch (error::Error &) {}
+      ::shutdown(socket.get_fd(), 2);
+      reader.join();
+#ifdef __linux__
+      ::close(wake_fd);
+#endif
+    }
+    
+    void connect(const std::string &addr, int port)
+    {
+      connect(Addr{addr, port});
+    }
+    
+    void connect(const Addr &addr)
+    {
+      if (addr.family() != AF_INET)
+      {
+        socket = Socket(addr);
+      }
+      socket.connect(addr);
+      if (addr.family() == AF_INET) socket.set_keepalive(config.tcp_keepalive);
+#ifdef QWRPC_HAS_SHM
+      if (config.mode == ClientMode::shared_memory)
+      {
+        error::qwrpc_assert(addr.family() == AF_UNIX, error::shm::not_unix_socket);
+        shm = shm::Channel::create(config.shm_capacity);
+        shm->send_to(socket.get_fd());
+        reader = std::thread([this] { shm_loop(); });
+        // Compression is pointless here.
+        char hello = static_cast<char>(hello_flags() & ~HELLO_COMPRESS);
+        {
+          std::lock_guard<std::mutex> lock(send_mtx);
+          shm_send(&hello, 1, 0, FrameType::hello);
+        }
+        return;
+      }
+#endif
+      // Before anything else, calls go out uncompressed and as czh until the answer arrives.
+      socket.send(std::string(1, hello_flags()), 0, FrameType::hello);
+#ifdef QWRPC_HAS_IO_URING
+      if (config.mode == ClientMode::io_uring)
+      {
+        try
+        {
+          ring = std::make_unique<uring::Uring>(64);
+          evfd = eventfd(0, EFD_CLOEXEC);
+          error::qwrpc_assert(evfd != -1, error::connector::eventfd_error);
+          reader = std::thread([this] { uring_loop(); });
+          return;
+        }
+        catch (error::Error &err)
+        {
+          logger::warn(logger::no_fmt, err.get_detail(), ", falling back to a reader thread.");
+          ring = nullptr;
+        }
+      }
+#endif
+#ifdef __linux__
+      wake_fd = eventfd(0, EFD_CLOEXEC);
+      error::qwrpc_assert(wake_fd != -1, error::connector::eventfd_error);
+#endif
+      reader = std::thread([this] { read_loop(); });
+    }
+    
+    bool is_broken() const { return broken; }
+    
+    // Whether requests may go out in the binary envelope.
+    bool binary_envelope() const { return binary; }
+    
+    // The method table the server sent with its hello, null until then or if it sent none.
+    std::shared_ptr<const std::string> get_method_table() const
+    {
+      std::lock_guard<std::mutex> lock(table_mtx);
+      return method_table;
+    }
+    
+    // Lets the layer above decode the method table once per connection. A replaced connection starts without.
+    template<typename T>
+    std::shared_ptr<const T> get_decoded_table() const
+    {
+      std::lock_guard<std::mutex> lock(table_mtx);
+      return std::static_pointer_cast<const T>(decoded_table);
+    }
+    
+    void set_decoded_table(std::shared_ptr<const void> table)
+    {
+      std::lock_guard<std::mutex> lock(table_mtx);
+      decoded_table = std::move(table);
+    }
+    
+    std::size_t outstanding() const { return in_flight; }
+    
+    // `on_item` is only needed if the response is streamed. Returns the id of the call, for cancel().
+    uint64_t async_send(const std::string &str, Callback &&cb, ItemCallback &&on_item = nullptr)
+    {
+      return start(str, std::move(cb), std::move(on_item), FrameType::message);
+    }
+    
+    // Like async_send(), but the call is cancelled with error::connector::timed_out once `deadline` has passed.
+    // `cb` then runs on the reader thread or loop of the connection, like for a response.
+    uint64_t async_send_until(const std::string &str, Callback &&cb, std::chrono::steady_clock::time_point deadline)
+    {
+      return start(str, std::move(cb), nullptr, FrameType::message, deadline);
+    }
+    
+    std::future<std::string> async_send(const std::string &str)
+    {
+      return async_send_stream(str, nullptr);
+    }
+    
+    // Like async_send(), `id` is set to the id of the call.
+    std::future<std::string> async_send(const std::string &str, uint64_t &id)
+    {
+      auto promise = std::make_shared<std::promise<std::string>>();
+      auto ret = promise->get_future();
+      id = async_send(str, fulfil(promise));
+      return ret;
+    }
+    
+    // Like async_send(), every stream item is passed to `on_item` as it arrives.
+    std::future<std::string> async_send_stream(const std::string &str, ItemCallback &&on_item)
+    {
+      auto promise = std::make_shared<std::promise<std::string>>();
+      auto ret = promise->get_future();
+      async_send(str, fulfil(promise), std::move(on_item));
+      return ret;
+    }
+    
+    std::string send_and_recv(const std::string &str)
+    {
+      return async_send(str).get();
+    }
+    
+    // Waits for the response of the call `id` until `deadline`. The call is cancelled then,
+    // and error::connector::timed_out thrown.
+    std::string wait_until(std::future<std::string> &res, uint64_t id, std::chrono::steady_clock::time_point deadline)
+    {
+      if (res.wait_until(deadline) == std::future_status::timeout)
+      {
+        cancel(id, std::make_exception_ptr(error::Error(error::connector::timed_out)));
+      }
+      // Unless the response came in the meantime, this throws what cancel() passed.
+      return res.get();
+    }
+    
+    // Gives up on a call: its callback gets `err` right away, and the server is told to stop working on it.
+    // Returns false if the call has already completed. Items of a streaming call may still arrive.
+    bool cancel(uint64_t id, std::exception_ptr err)
+    {
+      Callback cb;
+      {
+        std::lock_guard<std::mutex> lock(pending_mtx);
+        auto it = pending.find(id);
+        if (it == pending.end()) return false;
+        cb = std::move(it->second);
+        pending.erase(it);
+        // The ItemCallback is left to the reader thread, which may be calling it right now.
+        end_upload(id);
+        forget_deadline(id);
+        --in_flight;
+      }
+      cb({}, err);
+      try
+      {
+        send_message({}, id, FrameType::cancel);
+      }
+      catch (error::Error &)
+      {
+        // A broken connection ends the call on the server anyway.
+      }
+      return true;
+    }
+    
+    // Starts a call whose argument follows as items, sent with upload() and ended by finish_upload().
+    // `cb` gets the response. Returns the id of the call.
+    uint64_t start_upload(const std::string &str, Callback &&cb)
+    {
+      return start(str, std::move(cb), nullptr, FrameType::stream_begin);
+    }
+    
+    // Blocks until the server has granted credit for all of `item`, which can't be larger than
+    // MAX_STREAM_ITEM. Returns false without sending anything if the call has already been answered.
+    bool upload(uint64_t id, const std::string &item)
+    {
+      error::qwrpc_assert(item.size() <= MAX_STREAM_ITEM, error::connector::stream_item_too_large);
+      std::shared_ptr<Upload> up;
+      {
+        std::lock_guard<std::mutex> lock(pending_mtx);
+        auto it = uploads.find(id);
+        if (it == uploads.end()) return false;
+        up = it->second;
+      }
+      {
+        std::unique_lock<std::mutex> lock(up->mtx);
+        auto size = static_cast<int64_t>(item.size());
+        up->cond.wait(lock, [&up, size] { return (up->credit > 0 && up->credit >= size) || up->done; });
+        if (up->done) return false;
+        up->credit -= size;
+      }
+      send_message(item, id, FrameType::stream_item);
+      return true;
+    }
+    
+    void finish_upload(uint64_t id)
+    {
+      try
+      {
+        send_message({}, id, FrameType::stream_end);
+      }
+      catch (error::Error &)
+      {
+        // A broken connection fails the call anyway.
+      }
+    }
+  
+  private:
+    static Callback fulfil(const std::shared_ptr<std::promise<std::string>> &promise)
+    {
+      return [promise](std::string &&res, std::exception_ptr err)
+      {
+        if (err)
+        {
+          promise->set_exception(err);
+        }
+        else
+        {
+          promise->set_value(std::move(res));
+        }
+      };
+    }
+    
+    uint64_t start(const std::string &str, Callback &&cb, ItemCallback &&on_item, FrameType type,
+                   std::optional<std::chrono::steady_clock::time_point> deadline = std::nullopt)
+    {
+      auto id = next_id++;
+      {
+        // Register before sending, the response may arrive before send() returns.
+        std::unique_lock<std::mutex> lock(pending_mtx);
+        if (broken)
+        {
+          lock.unlock();
+          cb({}, broken_by);
+          return id;
+        }
+        pending.emplace(id, std::move(cb));
+        if (on_item != nullptr) streams.emplace(id, std::move(on_item));
+        if (type == FrameType::stream_begin) uploads.emplace(id, std::make_shared<Upload>());
+        if (deadline.has_value())
+        {
+          auto it = deadlines.emplace(*deadline, id);
+          deadline_of.emplace(id, it);
+          // Only an earliest deadline changes when the timer wakes us.
+          if (it == deadlines.begin())
+          {
+            timed = true;
+            DeadlineTimer::get().schedule(this, *deadline, [this] { return expire_deadlines(); });
+          }
+        }
+        ++in_flight;
+      }
+      try
+      {
+        send_message(str, id, type);
+      }
+      catch (...)
+      {
+        Callback failed;
+        {
+          std::lock_guard<std::mutex> lock(pending_mtx);
+          auto it = pending.find(id);
+          if (it == pending.end()) return id;
+          failed = std::move(it->second);
+          pending.erase(it);
+          // Nothing can arrive for a request that never left.
+          streams.erase(id);
+          end_upload(id);
+          forget_deadline(id);
+          --in_flight;
+        }
+        failed({}, std::current_exception());
+      }
+      return id;
+    }
+    
+    // Takes send_mtx per frame, so that a big message doesn't hold back the other calls.
+    // Compresses before taking it.
+    void send_message(const std::string &message, uint64_t id, FrameType type)
+    {
+      std::string packed;
+      uint16_t flags = 0;
+      auto min_size = compress_min.load(std::memory_order_relaxed);
+      if (min_size != 0 && message.size() >= min_size && compress::compress(message.data(), message.size(), packed))
+      {
+        flags = FRAME_COMPRESSED;
+      }
+      const auto &str = flags == 0 ? message : packed;
+#ifdef QWRPC_HAS_IO_URING
+      if (ring != nullptr)
+      {
+        {
+          std::lock_guard<std::mutex> lock(send_mtx);
+          append_frame(outbox, {id, str, type, flags});
+        }
+        // Only the first frame after the loop picked up the outbox needs to wake it.
+        if (!wake_pending.exchange(true))
+        {
+          wakeup();
+        }
+        return;
+      }
+#endif
+      for_each_chunk(str.size(), [this, &str, id, type, flags](std::size_t pos, std::size_t n, uint16_t more)
+      {
+        std::lock_guard<std::mutex> lock(send_mtx);
+#ifdef QWRPC_HAS_SHM
+        if (shm != nullptr)
+        {
+          shm_send(str.data() + pos, n, id, type, flags | more);
+          return;
+        }
+#endif
+        socket.send_frame(str.data() + pos, n, id, type, flags | more);
+      });
+    }
+    
+    // Called with pending_mtx held. Wakes upload() callers, they return false from then on.
+    void end_upload(uint64_t id)
+    {
+      auto it = uploads.find(id);
+      if (it == uploads.end()) return;
+      {
+        std::lock_guard<std::mutex> lock(it->second->mtx);
+        it->second->done = true;
+      }
+      it->second->cond.notify_all();
+      uploads.erase(it);
+    }
+    
+    // Called with pending_mtx held.
+    void forget_deadline(uint64_t id)
+    {
+      if (deadline_of.empty()) return;
+      auto it = deadline_of.find(id);
+      if (it == deadline_of.end()) return;
+      deadlines.erase(it->second);
+      deadline_of.erase(it);
+    }
+    
+    // On the DeadlineTimer's thread: hands the calls whose deadline has passed to the reader and wakes it.
+    // Nothing here blocks, a stalled connection mustn't hold up the deadlines of the others.
+    // Returns the next deadline.
+    std::optional<std::chrono::steady_clock::time_point> expire_deadlines()
+    {
+      std::optional<std::chrono::steady_clock::time_point> next;
+      bool any = false;
+      {
+        std::lock_guard<std::mutex> lock(pending_mtx);
+        auto now = std::chrono::steady_clock::now();
+        while (!deadlines.empty() && deadlines.begin()->first <= now)
+        {
+          auto id = deadlines.begin()->second;
+          forget_deadline(id);
+          expired.emplace_back(id);
+          any = true;
+        }
+        if (!deadlines.empty()) next = deadlines.begin()->first;
+        if (any) expired_pending = true;
+      }
+      if (any) wake_reader();
+      return next;
+    }
+    
+    void wake_reader()
+    {
+#ifdef QWRPC_HAS_IO_URING
+      if (ring != nullptr)
+      {
+        wakeup();
+        return;
+      }
+#endif
+#ifdef QWRPC_HAS_SHM
+      if (shm != nullptr)
+      {
+        shm->notify(shm::response_data);
+        return;
+      }
+#endif
+#ifdef __linux__
+      uint64_t one = 1;
+      [[maybe_unused]] auto ret = ::write(wake_fd, &one, sizeof(one));
+#endif
+      // Elsewhere read_loop() looks every READ_TICK.
+    }
+    
+    // On the reader thread or loop: cancels what expire_deadlines() handed over.
+    void cancel_expired()
+    {
+      if (!expired_pending.exchange(false)) return;
+      std::vector<uint64_t> ids;
+      {
+        std::lock_guard<std::mutex> lock(pending_mtx);
+        ids.swap(expired);
+      }
+      for (auto id: ids)
+      {
+        cancel(id, std::make_exception_ptr(error::Error(error::connector::timed_out)));
+      }
+    }
+    
+    char hello_flags() const
+    {
+      return static_cast<char>((config.compression ? HELLO_COMPRESS : 0)
+                               | (config.binary_envelope ? HELLO_BINARY : 0)
+                               | (config.binary_envelope && config.method_ids ? HELLO_METHODS : 0)
+                               | CONTAINER_FORMAT);
+    }
+    
+    void on_frame(Frame &&frame)
+    {
+      if (frame.type == FrameType::hello)
+      {
+        if (frame.content.empty() || (frame.content[0] & HELLO_CONTAINERS) != CONTAINER_FORMAT)
+        {
+          logger::error(logger::no_fmt, error::connector::container_format_mismatch);
+          fail_all(std::make_exception_ptr(error::Error(error::connector::container_format_mismatch)));
+          ::shutdown(socket.get_fd(), 2);
+          return;
+        }
+        if (frame.content[0] & HELLO_COMPRESS)
+        {
+          compress_min = config.compress_min_size;
+        }
+        binary = frame.content[0] & HELLO_BINARY;
+        if (frame.content[0] & HELLO_METHODS)
+        {
+          std::lock_guard<std::mutex> lock(table_mtx);
+          method_table = std::make_shared<const std::string>(frame.content.substr(1));
+        }
+        return;
+      }
+      if (frame.type == FrameType::ping)
+      {
+        send_message(frame.content, frame.request_id, FrameType::pong);
+        return;
+      }
+      if (frame.type == FrameType::pong) return;
+      if (frame.type == FrameType::credit)
+      {
+        std::shared_ptr<Upload> up;
+        {
+          std::lock_guard<std::mutex> lock(pending_mtx);
+          auto it = uploads.find(frame.request_id);
+          if (it == uploads.end()) return;
+          up = it->second;
+        }
+        {
+          std::lock_guard<std::mutex> lock(up->mtx);
+          up->credit += static_cast<int64_t>(decode_credit(frame.content));
+        }
+        up->cond.notify_all();
+        return;
+      }
+      if (frame.type == FrameType::stream_item)
+      {
+        ItemCallback *on_item;
+        {
+          std::lock_guard<std::mutex> lock(pending_mtx);
+          auto it = streams.find(frame.request_id);
+          if (it == streams.end()) return;
+          // Inserting doesn't invalidate it, and only this thread erases.
+          on_item = &it->second;
+        }
+        (*on_item)(std::move(frame.content));
+        return;
+      }
+      Callback cb;
+      {
+        std::lock_guard<std::mutex> lock(pending_mtx);
+        auto it = pending.find(frame.request_id);
+        if (it == pending.end())
+        {
+          // The end of a cancelled call.
+          streams.erase(frame.request_id);
+          return;
+        }
+        cb = std::move(it->second);
+        pending.erase(it);
+        streams.erase(frame.request_id);
+        end_upload(frame.request_id);
+        forget_deadline(frame.request_id);
+        --in_flight;
+      }
+      cb(std::move(frame.content), nullptr);
+    }
+    
+    void fail_all(std::exception_ptr err)
+    {
+      std::unordered_map<uint64_t, Callback> failed;
+      {
+        std::lock_guard<std::mutex> lock(pending_mtx);
+        broken = true;
+        if (broken_by == nullptr) broken_by = err;
+        failed.swap(pending);
+        streams.clear();
+        while (!uploads.empty())
+        {
+          end_upload(uploads.begin()->first);
+        }
+        deadlines.clear();
+        deadline_of.clear();
+        in_flight = 0;
+      }
+      for (auto &r: failed)
+      {
+        r.second({}, err);
+      }
+    }
+    
+    void read_loop()
+    {
+      try
+      {
+        Frame frame;
+        bool pinged = false;
+        auto last_recv = std::chrono::steady_clock::now();
+        // Pings after `keepalive` of silence, gives up after twice that.
+        auto check_keepalive = [this, &pinged, &last_recv]
+        {
+          if (config.keepalive.count() == 0) return;
+          auto silent = std::chrono::steady_clock::now() - last_recv;
+          error::qwrpc_assert(!pinged || silent < 2 * config.keepalive, error::connector::keepalive_failed);
+          if (!pinged && silent >= config.keepalive)
+          {
+            send_message({}, 0, FrameType::ping);
+            pinged = true;
+          }
+        };
+#ifdef __linux__
+        while (true)
+        {
+          while (rbuf.next(frame))
+          {
+            on_frame(std::move(frame));
+          }
+          int timeout = -1;
+          if (config.keepalive.count() != 0)
+          {
+            auto due = last_recv + (pinged ? 2 : 1) * config.keepalive;
+            timeout = static_cast<int>(std::max<std::chrono::milliseconds::rep>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(due - std::chrono::steady_clock::now())
+                    .count() + 1, 0));
+          }
+          pollfd fds[2] = {{socket.get_fd(), POLLIN, 0}, {wake_fd, POLLIN, 0}};
+          auto n = ::poll(fds, 2, timeout);
+          if (n == -1 && errno == EINTR) continue;
+          error::qwrpc_assert(n != -1, error::connector::socket_recv_error);
+          if (fds[1].revents != 0)
+          {
+            uint64_t cnt;
+            [[maybe_unused]] auto ret = ::read(wake_fd, &cnt, sizeof(cnt));
+            cancel_expired();
+          }
+          if (fds[0].revents != 0)
+          {
+            socket.recv_some(rbuf);
+            last_recv = std::chrono::steady_clock::now();
+            pinged = false;
+          }
+          check_keepalive();
+        }
+#else
+        // Nothing can wake a thread blocked in recv() here, so it looks for expired calls every READ_TICK.
+        socket.set_recv_timeout(READ_TICK);
+        while (true)
+        {
+          if (socket.recv(rbuf, frame))
+          {
+            last_recv = std::chrono::steady_clock::now();
+            pinged = false;
+            on_frame(std::move(frame));
+          }
+          cancel_expired();
+          check_keepalive();
+        }
+#endif
+      }
+      catch (...)
+      {
+        fail_all(std::current_exception());
+      }
+    }
+
+#ifdef QWRPC_HAS_IO_URING
+    void wakeup() const
+    {
+      uint64_t one = 1;
+      [[maybe_unused]] auto ret = ::write(evfd, &one, sizeof(one));
+    }
+    
+    void uring_loop()
+    {
+      enum Op : uint64_t
+      {
+        op_recv, op_wakeup, op_send, op_timer
+      };
+      try
+      {
+        auto &buf = uring_buf;
+        buf.resize(RECV_CHUNK);
+        ring->register_buffers({{buf.data(), buf.size()}});
+        std::string sending;
+        std::size_t spos = 0;
+        bool send_in_flight = false;
+        // Looks at the connection twice per ClientConfig::keepalive.
+        auto half = config.keepalive / 2;
+        tick.tv_sec = half.count() / 1000;
+        tick.tv_nsec = half.count() % 1000 * 1000000;
+        auto last_recv = std::chrono::steady_clock::now();
+        bool pinged = false;
+        auto arm_recv = [&]
+        {
+          auto sqe = ring->get_sqe();
+          uring::Uring::prep_rw(sqe, IORING_OP_READ_FIXED, socket.get_fd(), buf.data(),
+                                static_cast<unsigned>(buf.size()), 0, op_recv);
+          sqe->buf_index = 0;
+        };
+        auto arm_wakeup = [&]
+        {
+          uring::Uring::prep_rw(ring->get_sqe(), IORING_OP_READ, evfd, &evbuf, sizeof(evbuf), 0, op_wakeup);
+        };
+        auto arm_timer = [&]
+        {
+          uring::Uring::prep_rw(ring->get_sqe(), IORING_OP_TIMEOUT, -1, &tick, 1, 0, op_timer);
+        };
+        auto arm_send = [&]
+        {
+          auto sqe = ring->get_sqe();
+          uring::Uring::prep_rw(sqe, IORING_OP_SEND, socket.get_fd(), sending.data() + spos,
+                                static_cast<unsigned>(std::min<std::size_t>(sending.size() - spos, 1u << 30)),
+                                0, op_send);
+          sqe->msg_flags = SEND_FLAGS;
+          send_in_flight = true;
+        };
+        arm_recv();
+        arm_wakeup();
+        if (config.keepalive.count() != 0) arm_timer();
+        while (true)
+        {
+          if (!send_in_flight)
+          {
+            sending.clear();
+            spos = 0;
+            {
+              std::lock_guard<std::mutex> lock(send_mtx);
+              sending.swap(outbox);
+            }
+            if (!sending.empty())
+            {
+              arm_send();
+            }
+            else if (stopping)
+            {
+              return;
+            }
+          }
+          ring->submit(1);
+          ring->for_each_cqe([&](const io_uring_cqe &cqe)
+                             {
+                               switch (cqe.user_data)
+                               {
+                                 case op_recv:
+                                 {
+                                   error::qwrpc_assert(cqe.res > 0, error::connector::socket_recv_error);
+                                   std::memcpy(rbuf.prepare(cqe.res), buf.data(), cqe.res);
+                                   rbuf.commit(cqe.res);
+                                   last_recv = std::chrono::steady_clock::now();
+                                   pinged = false;
+                                   Frame frame;
+                                   while (rbuf.next(frame))
+                                   {
+                                     on_frame(std::move(frame));
+                                   }
+                                   arm_recv();
+                                   break;
+                                 }
+                                 case op_wakeup:
+                                   wake_pending = false;
+                                   cancel_expired();
+                                   arm_wakeup();
+                                   break;
+                                 case op_send:
+                                   error::qwrpc_assert(cqe.res >= 0, error::connector::socket_send_error);
+                                   spos += cqe.res;
+                                   if (spos < sending.size())
+                                   {
+                                     arm_send();
+                                   }
+                                   else
+                                   {
+                                     send_in_flight = false;
+                                   }
+                                   break;
+                                 case op_timer:
+                                 {
+                                   auto silent = std::chrono::steady_clock::now() - last_recv;
+                                   error::qwrpc_assert(!pinged || silent < 2 * config.keepalive,
+                                                       error::connector::keepalive_failed);
+                                   if (!pinged && silent >= config.keepalive)
+                                   {
+                                     std::lock_guard<std::mutex> lock(send_mtx);
+                                     append_frame(outbox, {0, "", FrameType::ping});
+                                     pinged = true;
+                                   }
+                                   arm_timer();
+                                   break;
+                                 }
+                               }
+                             });
+        }
+      }
+      catch (...)
+      {
+        // Ends a send that may still be in flight, its buffer goes away with this frame.
+        ::shutdown(socket.get_fd(), SHUT_RDWR);
+        fail_all(std::current_exception());
+      }
+    }
+#endif
+
+#ifdef QWRPC_HAS_SHM
+    // Called with send_mtx held.
+    void shm_send(const char *data, std::size_t size, uint64_t id, FrameType type = FrameType::message,
+                  uint16_t flags = 0)
+    {
+      Msg msg{.magic = MAGIC, .type = type, .flags = flags, .request_id = id, .content_length = size};
+      shm_write(reinterpret_cast<const char *>(&msg), sizeof(Msg));
+      shm_write(data, size);
+      shm->notify_if_waiting(shm->request().header()->consumer_waiting, shm::request_data);
+    }
+    
+    void shm_write(const char *data, std::size_t size)
+    {
+      auto &ring = shm->request();
+      auto hdr = ring.header();
+      while (size > 0)
+      {
+        auto n = ring.write(data, size);
+        data += n;
+        size -= n;
+        if (size == 0) break;
+        // Full, let the server drain what is there before waiting for space.
+        shm->notify_if_waiting(hdr->consumer_waiting, shm::request_data);
+        error::qwrpc_assert(!broken, error::connector::socket_broken);
+        send_waiter.wait([&ring, this] { return ring.writable() > 0 || broken; },
+                         hdr->producer_waiting, shm->fd(shm::request_space), socket.get_fd());
+      }
+    }
+    
+    void shm_loop()
+    {
+      auto &ring = shm->response();
+      auto hdr = ring.header();
+      shm::Waiter waiter;
+      try
+      {
+        while (!stopping)
+        {
+          waiter.wait([&ring, this] { return ring.readable() > 0 || stopping || expired_pending; },
+                      hdr->consumer_waiting, shm->fd(shm::response_data), socket.get_fd());
+          cancel_expired();
+          auto n = ring.readable();
+          if (n == 0)
+          {
+            // The server never writes to the socket after the handshake, so it being readable means EOF.
+            pollfd pfd{socket.get_fd(), POLLIN, 0};
+            error::qwrpc_assert(stopping || ::poll(&pfd, 1, 0) == 0, error::connector::socket_broken);
+            continue;
+          }
+          ring.read(rbuf.prepare(n), n);
+          rbuf.commit(n);
+          shm->notify_if_waiting(hdr->producer_waiting, shm::response_space);
+          Frame frame;
+          while (rbuf.next(frame))
+          {
+            on_frame(std::move(frame));
+          }
+        }
+      }
+      catch (...)
+      {
+        fail_all(std::current_exception());
+      }
+    }
+#endif
+  };
+  
+  // Keeps several connections to one endpoint, every call goes to the one with the fewest requests in flight.
+  class ClientPool
+  {
+  private:
+    struct Slot
+    {
+      std::shared_ptr<Client> client;
+      // A caller is connecting it right now, outside the lock.
+      bool connecting = false;
+      // After a failed connect it is skipped until then.
+      std::chrono::steady_clock::time_point retry_at;
+      std::chrono::milliseconds backoff{0};
+    };
+    
+    Addr addr;
+    ClientConfig config;
+    std::mutex mtx;
+    std::vector<Slot> slots;
+    // Why the last reconnect failed, thrown while no connection is usable.
+    std::exception_ptr last_error;
+  public:
+    ClientPool(const Addr &addr_, const ClientConfig &config_ = {})
+        : addr(addr_), config(config_), slots(std::max<std::size_t>(config_.connections, 1))
+    {
+      for (auto &r: slots)
+      {
+        r.client = make_client();
+      }
+    }
+    
+    // The connection with the fewest calls in flight. Broken connections are replaced when they are next
+    // looked at, in-flight calls keep the old one alive. A call reconnects at most one of them, without
+    // holding the lock, and connections that failed to reconnect wait for their back-off to pass.
+    std::shared_ptr<Client> get()
+    {
+      std::shared_ptr<Client> best;
+      std::size_t due = slots.size();
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto now = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < slots.size(); ++i)
+        {
+          auto &r = slots[i];
+          if (r.client != nullptr && r.client->is_broken()) r.client = nullptr;
+          if (r.client == nullptr)
+          {
+            if (due == slots.size() && !r.connecting && now >= r.retry_at)
+            {
+              r.connecting = true;
+              due = i;
+            }
+            continue;
+          }
+          if (best == nullptr || r.client->outstanding() < best->outstanding())
+          {
+            best = r.client;
+          }
+        }
+        if (due == slots.size())
+        {
+          if (best != nullptr) return best;
+          if (last_error != nullptr) std::rethrow_exception(last_error);
+          throw error::Error(error::connector::socket_broken);
+        }
+      }
+      std::shared_ptr<Client> fresh;
+      std::exception_ptr err;
+      try
+      {
+        fresh = make_client();
+      }
+      catch (...)
+      {
+        err = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lock(mtx);
+      auto &r = slots[due];
+      r.connecting = false;
+      if (fresh != nullptr)
+      {
+        r.client = fresh;
+        r.backoff = std::chrono::milliseconds(0);
+        // Nothing is in flight on it yet.
+        return fresh;
+      }
+      r.backoff = r.backoff.count() == 0 ? config.reconnect_backoff
+                                         : std::min(r.backoff * 2, config.reconnect_backoff * 64);
+      r.retry_at = std::chrono::steady_clock::now() + r.backoff;
+      last_error = err;
+      if (best != nullptr) return best;
+      std::rethrow_exception(err);
+    }
+    
+    std::size_t size() const { return slots.size(); }
+    
+    const ClientConfig &get_config() const { return config; }
+  
+  private:
+    std::shared_ptr<Client> make_client() const
+    {
+      auto cli = std::make_shared<Client>(config);
+      cli->connect(addr);
+      return cli;
+    }
+  };
+}
+#endif
@@ -0,0 +1,304 @@
+//   Copyright 2023 qwrpc - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef QWRPC_CORO_HPP
+#define QWRPC_CORO_HPP
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace qwrpc::coro
+{
+  template<typename T = void>
+  class Task;
+  
+  namespace detail
+  {
+    // Resumes whoever awaited the finished coroutine, in the same step.
+    struct FinalAwaiter
+    {
+      bool await_ready() const noexcept { return false; }
+      
+      template<typename Promise>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) const noexcept
+      {
+        auto next = h.promise().continuation;
+        return next ? next : std::noop_coroutine();
+      }
+      
+      void await_resume() const noexcept {}
+    };
+    
+    struct PromiseBase
+    {
+      std::coroutine_handle<> continuation;
+      std::exception_ptr err;
+      
+      std::suspend_always initial_suspend() const noexcept { return {}; }
+      
+      FinalAwaiter final_suspend() const noexcept { return {}; }
+      
+      void unhandled_exception() { err = std::current_exception(); }
+    };
+    
+    template<typename T>
+    struct Promise : PromiseBase
+    {
+      std::optional<T> value;
+      
+      Task<T> get_return_object();
+      
+      template<typename U>
+      void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+      
+      T result()
+      {
+        if (err) std::rethrow_exception(err);
+        return std::move(*value);
+      }
+    };
+    
+    template<>
+    struct Promise<void> : PromiseBase
+    {
+      Task<void> get_return_object();
+      
+      void return_void() const noexcept {}
+      
+      void result() const
+      {
+        if (err) std::rethrow_exception(err);
+      }
+    };
+    
+    // Starts the task, and resumes the awaiting coroutine once it has finished.
+    template<typename Promise>
+    struct TaskAwaiter
+    {
+      std::coroutine_handle<Promise> handle;
+      
+      bool await_ready() const noexcept { return handle.done(); }
+      
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) const noexcept
+      {
+        handle.promise().continuation = awaiting;
+        return handle;
+      }
+    };
+    
+    // A coroutine nobody waits for. It starts at once and frees itself when it is done.
+    struct Detached
+    {
+      struct promise_type
+      {
+        Detached get_return_object() const noexcept { return {}; }
+        
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        
+        void return_void() const noexcept {}
+        
+        void unhandled_exception() const noexcept { std::terminate(); }
+      };
+    };
+  }
+  
+  // A coroutine that starts when it is awaited, and resumes its awaiter when it finishes.
+  // Its result or exception is passed on by co_await. Run the outermost one with sync_wait() or spawn().
+  template<typename T>
+  class Task
+  {
+  public:
+    using promise_type = detail::Promise<T>;
+  private:
+    std::coroutine_handle<promise_type> handle;
+  public:
+    explicit Task(std::coroutine_handle<promise_type> handle_) : handle(handle_) {}
+    
+    Task(Task &&other) noexcept: handle(std::exchange(other.handle, nullptr)) {}
+    
+    Task &operator=(Task &&other) noexcept
+    {
+      if (this != &other)
+      {
+        if (handle) handle.destroy();
+        handle = std::exchange(other.handle, nullptr);
+      }
+      return *this;
+    }
+    
+    Task(const Task &) = delete;
+    
+    ~Task()
+    {
+      if (handle) handle.destroy();
+    }
+    
+    auto operator co_await() noexcept
+    {
+      struct Awaiter : detail::TaskAwaiter<promise_type>
+      {
+        T await_resume() const { return this->handle.promise().result(); }
+      };
+      return Awaiter{{handle}};
+    }
+    
+    // Runs the task to its end without taking the result, it is left for result().
+    auto join() noexcept
+    {
+      struct Awaiter : detail::TaskAwaiter<promise_type>
+      {
+        void await_resume() const noexcept {}
+      };
+      return Awaiter{{handle}};
+    }
+    
+    // Only once the task is done.
+    T result() { return handle.promise().result(); }
+  };
+  
+  namespace detail
+  {
+    template<typename T>
+    Task<T> Promise<T>::get_return_object()
+    {
+      return Task<T>{std::coroutine_handle<Promise<T>>::from_promise(*this)};
+    }
+    
+    inline Task<void> Promise<void>::get_return_object()
+    {
+      return Task<void>{std::coroutine_handle<Promise<void>>::from_promise(*this)};
+    }
+    
+    // Owns the promise, so that the waiting thread may return as soon as the value is set.
+    template<typename T>
+    Detached run_to_promise(Task<T> task, std::promise<T> promise)
+    {
+      try
+      {
+        if constexpr (std::is_void_v<T>)
+        {
+          co_await std::move(task);
+          promise.set_value();
+        }
+        else
+        {
+          promise.set_value(co_await std::move(task));
+        }
+      }
+      catch (...)
+      {
+        promise.set_exception(std::current_exception());
+      }
+    }
+    
+    inline Detached run_detached(Task<void> task)
+    {
+      try
+      {
+        co_await std::move(task);
+      }
+      catch (...) {}
+    }
+    
+    // Counts the tasks of a when_all() down, the last one resumes it.
+    struct Latch
+    {
+      std::atomic<std::size_t> remaining;
+      std::coroutine_handle<> waiting;
+      
+      void arrive()
+      {
+        if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) waiting.resume();
+      }
+    };
+    
+    template<typename T>
+    Detached run_and_arrive(Task<T> &task, Latch &latch)
+    {
+      co_await task.join();
+      latch.arrive();
+    }
+    
+    template<typename T>
+    struct AllDone
+    {
+      std::vector<Task<T>> &tasks;
+      Latch latch;
+      
+      bool await_ready() const noexcept { return tasks.empty(); }
+      
+      bool await_suspend(std::coroutine_handle<> awaiting)
+      {
+        latch.waiting = awaiting;
+        // One more, so that tasks finishing while the others are being started can't resume us yet.
+        latch.remaining.store(tasks.size() + 1, std::memory_order_relaxed);
+        for (auto &r: tasks)
+        {
+          run_and_arrive(r, latch);
+        }
+        return latch.remaining.fetch_sub(1, std::memory_order_acq_rel) != 1;
+      }
+      
+      void await_resume() const noexcept {}
+    };
+  }
+  
+  // Blocks the calling thread until `task` is done, for starting coroutines from ordinary code.
+  template<typename T>
+  T sync_wait(Task<T> task)
+  {
+    std::promise<T> promise;
+    auto ret = promise.get_future();
+    detail::run_to_promise(std::move(task), std::move(promise));
+    return ret.get();
+  }
+  
+  // Starts `task` and returns at its first suspension. Its exception, if any, is dropped.
+  inline void spawn(Task<void> task)
+  {
+    detail::run_detached(std::move(task));
+  }
+  
+  // Runs all tasks at the same time, and returns their results in order once all of them are done.
+  // If some failed, the first of them rethrows.
+  template<typename T>
+  Task<std::vector<T>> when_all(std::vector<Task<T>> tasks)
+  {
+    co_await detail::AllDone<T>{tasks, {}};
+    std::vector<T> ret;
+    ret.reserve(tasks.size());
+    for (auto &r: tasks)
+    {
+      ret.emplace_back(r.result());
+    }
+    co_return ret;
+  }
+  
+  inline Task<void> when_all(std::vector<Task<void>> tasks)
+  {
+    co_await detail::AllDone<void>{tasks, {}};
+    for (auto &r: tasks)
+    {
+      r.result();
+    }
+  }
+}
+#endif
@@ -0,0 +1,516 @@
+//   Copyright 2023 qwrpc - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef QWRPC_ENVELOPE_HPP
+#define QWRPC_ENVELOPE_HPP
+#pragma once
+
+#include "error.hpp"
+#include "method.hpp"
+#include "utils.hpp"
+#include "libczh/czh.hpp"
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace qwrpc::error::envelope
+{
+  constexpr auto malformed = "Invalid binary envelope.";
+  constexpr auto unsupported_version = "Unsupported binary envelope version.";
+  constexpr auto invalid_response = "Invalid response.";
+}
+namespace qwrpc::envelope
+{
+  // What goes around a call and its response, either as czh text or in the binary form:
+  //   MARK, VERSION, kind (uint8_t), then
+  //   request:  timeout in ms (uint32_t), and for a call the index of the method in the server's method
+  //             table (uint32_t), its id only if the index is BY_NAME, expected_ret (uint64_t) and args,
+  //             or the envelopes of the calls for a batch
+  //   response: status (uint8_t), and ret or the envelopes of the responses for a batch if it succeeded,
+  //             message, detail (uint8_t) and details if it failed
+  // Strings are prefixed with their length and lists with their size, as uint32_t. Arguments and return
+  // values are pairs of the type (uint64_t, method::TypeId::hash) and the data (a string). czh carries
+  // the names of the types instead. Numbers are in host byte order, like the frame header.
+  // czh text never starts with MARK, so a server tells them apart by the first byte.
+  constexpr char MARK = '\0';
+  // 2: types are hashes instead of names. 3: calls may go by the index of their method.
+  constexpr char VERSION = 3;
+  // The index of a call that names its method instead.
+  constexpr uint32_t BY_NAME = UINT32_MAX;
+  
+  enum class Kind : uint8_t { call, batch };
+  
+  enum class Status : uint8_t { success, failed };
+  
+  // What a failed response carries besides its message. In czh, the key it goes by.
+  enum class Detail : uint8_t
+  {
+    none,
+    // czh_error
+    request_error,
+    // expected_args
+    expected_args,
+    // expected_ret
+    expected_ret,
+    // qwrpc_error
+    invoke_error
+  };
+  
+  struct Request
+  {
+    Kind kind = Kind::call;
+    // How long the caller waits, 0 if it has no deadline.
+    uint32_t timeout = 0;
+    // Calls carry one of them, the index in the binary envelope once the client has the method table.
+    uint32_t index = BY_NAME;
+    std::string id;
+    method::TypeId expected_ret;
+    method::MethodParam args;
+    // The envelopes of the calls of a batch.
+    std::vector<std::string> batch;
+  };
+  
+  struct Response
+  {
+    Kind kind = Kind::call;
+    Status status = Status::success;
+    // Empty for methods returning void.
+    method::MethodParam ret;
+    // The envelopes of the responses of a batch.
+    std::vector<std::string> batch;
+    std::string message;
+    Detail detail = Detail::none;
+    std::vector<std::string> details;
+  };
+  
+  // A method as it is listed in the table a server sends with its hello, its index there is its id.
+  // With the types of the method, clients can reject calls that don't match it themselves.
+  struct MethodInfo
+  {
+    std::string name;
+    uint64_t signature = 0;
+    uint64_t ret = 0;
+    std::vector<uint64_t> args;
+    // The full names, for error messages.
+    std::string ret_name;
+    std::vector<std::string> arg_names;
+  };
+  
+  inline Response failure(std::string message, Detail detail = Detail::none, std::vector<std::string> details = {})
+  {
+    Response ret;
+    ret.status = Status::failed;
+    ret.message = std::move(message);
+    ret.detail = detail;
+    ret.details = std::move(details);
+    return ret;
+  }
+  
+  inline bool is_binary(const std::string &str) { return !str.empty() && str[0] == MARK; }
+  
+  namespace detail
+  {
+    inline void put_u8(std::string &out, uint8_t v) { out.push_back(static_cast<char>(v)); }
+    
+    inline void put_u32(std::string &out, uint32_t v) { out.append(reinterpret_cast<const char *>(&v), sizeof(v)); }
+    
+    inline void put_u64(std::string &out, uint64_t v) { out.append(reinterpret_cast<const char *>(&v), sizeof(v)); }
+    
+    inline void put_str(std::string &out, const std::string &str)
+    {
+      put_u32(out, static_cast<uint32_t>(str.size()));
+      out.append(str);
+    }
+    
+    inline void put_strs(std::string &out, const std::vector<std::string> &strs)
+    {
+      put_u32(out, static_cast<uint32_t>(strs.size()));
+      for (auto &r: strs) put_str(out, r);
+    }
+    
+    inline void put_param(std::string &out, const method::MethodParam &param)
+    {
+      put_u32(out, static_cast<uint32_t>(param.size()));
+      for (auto &r: param)
+      {
+        put_u64(out, r.get_type().hash);
+        put_str(out, r.get_data());
+      }
+    }
+    
+    inline std::size_t strs_size(const std::vector<std::string> &strs)
+    {
+      std::size_t n = sizeof(uint32_t);
+      for (auto &r: strs) n += sizeof(uint32_t) + r.size();
+      return n;
+    }
+    
+    inline std::size_t param_size(const method::MethodParam &param)
+    {
+      std::size_t n = sizeof(uint32_t);
+      for (auto &r: param) n += sizeof(uint64_t) + sizeof(uint32_t) + r.get_data().size();
+      return n;
+    }
+    
+    // Reads the fields of an envelope, throwing error::envelope::malformed instead of reading past its end.
+    class Cursor
+    {
+    private:
+      const char *pos;
+      const char *end;
+    public:
+      explicit Cursor(const std::string &str) : pos(str.data()), end(str.data() + str.size()) {}
+      
+      uint8_t u8()
+      {
+        need(1);
+        return static_cast<uint8_t>(*pos++);
+      }
+      
+      uint32_t u32()
+      {
+        need(sizeof(uint32_t));
+        uint32_t v;
+        std::memcpy(&v, pos, sizeof(v));
+        pos += sizeof(v);
+        return v;
+      }
+      
+      uint64_t u64()
+      {
+        need(sizeof(uint64_t));
+        uint64_t v;
+        std::memcpy(&v, pos, sizeof(v));
+        pos += sizeof(v);
+        return v;
+      }
+      
+      std::string str()
+      {
+        auto n = u32();
+        need(n);
+        std::string ret(pos, n);
+        pos += n;
+        return ret;
+      }
+      
+      // Checks the count against what is left first, a bogus one mustn't make us reserve gigabytes.
+      uint32_t count(std::size_t min_item_size)
+      {
+        auto n = u32();
+        error::qwrpc_assert(n <= static_cast<std::size_t>(end - pos) / min_item_size, error::envelope::malformed);
+        return n;
+      }
+      
+      std::vector<std::string> strs()
+      {
+        std::vector<std::string> ret(count(sizeof(uint32_t)));
+        for (auto &r: ret) r = str();
+        return ret;
+      }
+      
+      method::MethodParam param()
+      {
+        method::MethodParam ret;
+        auto n = count(sizeof(uint64_t) + sizeof(uint32_t));
+        ret.reserve(n);
+        for (uint32_t i = 0; i < n; ++i)
+        {
+          method::TypeId type{u64(), {}};
+          ret.emplace_back(str(), type);
+        }
+        return ret;
+      }
+      
+      // Checks MARK and VERSION.
+      void header()
+      {
+        error::qwrpc_assert(u8() == static_cast<uint8_t>(MARK), error::envelope::malformed);
+        error::qwrpc_assert(u8() == static_cast<uint8_t>(VERSION), error::envelope::unsupported_version);
+      }
+      
+      void finish() const { error::qwrpc_assert(pos == end, error::envelope::malformed); }
+    
+    private:
+      void need(std::size_t n) const
+      {
+        error::qwrpc_assert(n <= static_cast<std::size_t>(end - pos), error::envelope::malformed);
+      }
+    };
+    
+    template<typename E>
+    E to_enum(uint8_t v, E last)
+    {
+      error::qwrpc_assert(v <= static_cast<uint8_t>(last), error::envelope::malformed);
+      return static_cast<E>(v);
+    }
+    
+    constexpr const char *detail_keys[] = {"", "czh_error", "expected_args", "expected_ret", "qwrpc_error"};
+  }
+  
+  inline std::string encode(const Request &req)
+  {
+    using namespace detail;
+    std::string out;
+    if (req.kind == Kind::call)
+    {
+      out.reserve(7 + 2 * sizeof(uint32_t) + req.id.size() + sizeof(uint64_t) + param_size(req.args));
+    }
+    else
+    {
+      out.reserve(7 + strs_size(req.batch));
+    }
+    out.push_back(MARK);
+    out.push_back(VERSION);
+    put_u8(out, static_cast<uint8_t>(req.kind));
+    put_u32(out, req.timeout);
+    if (req.kind == Kind::call)
+    {
+      put_u32(out, req.index);
+      if (req.index == BY_NAME) put_str(out, req.id);
+      put_u64(out, req.expected_ret.hash);
+      put_param(out, req.args);
+    }
+    else
+    {
+      put_strs(out, req.batch);
+    }
+    return out;
+  }
+  
+  inline std::string encode(const Response &res)
+  {
+    using namespace detail;
+    std::string out;
+    if (res.status == Status::failed)
+    {
+      out.reserve(5 + sizeof(uint32_t) + res.message.size() + 1 + strs_size(res.details));
+    }
+    else
+    {
+      out.reserve(4 + (res.kind == Kind::call ? param_size(res.ret) : strs_size(res.batch)));
+    }
+    out.push_back(MARK);
+    out.push_back(VERSION);
+    put_u8(out, static_cast<uint8_t>(res.kind));
+    put_u8(out, static_cast<uint8_t>(res.status));
+    if (res.status == Status::failed)
+    {
+      put_str(out, res.message);
+      put_u8(out, static_cast<uint8_t>(res.detail));
+      put_strs(out, res.details);
+    }
+    else if (res.kind == Kind::call)
+    {
+      put_param(out, res.ret);
+    }
+    else
+    {
+      put_strs(out, res.batch);
+    }
+    return out;
+  }
+  
+  // Throws error::envelope::malformed or unsupported_version.
+  inline Request decode_request(const std::string &str)
+  {
+    detail::Cursor cur(str);
+    cur.header();
+    Request req;
+    req.kind = detail::to_enum(cur.u8(), Kind::batch);
+    req.timeout = cur.u32();
+    if (req.kind == Kind::call)
+    {
+      req.index = cur.u32();
+      if (req.index == BY_NAME) req.id = cur.str();
+      req.expected_ret.hash = cur.u64();
+      req.args = cur.param();
+    }
+    else
+    {
+      req.batch = cur.strs();
+    }
+    cur.finish();
+    return req;
+  }
+  
+  inline Response decode_response(const std::string &str)
+  {
+    detail::Cursor cur(str);
+    cur.header();
+    Response res;
+    res.kind = detail::to_enum(cur.u8(), Kind::batch);
+    res.status = detail::to_enum(cur.u8(), Status::failed);
+    if (res.status == Status::failed)
+    {
+      res.message = cur.str();
+      res.detail = detail::to_enum(cur.u8(), Detail::invoke_error);
+      res.details = cur.strs();
+    }
+    else if (res.kind == Kind::call)
+    {
+      res.ret = cur.param();
+    }
+    else
+    {
+      res.batch = cur.strs();
+    }
+    cur.finish();
+    return res;
+  }
+  
+  // The method table: MARK, VERSION, then the count of methods (uint32_t) and for every one of them its name,
+  // signature (uint64_t), return type and argument types, each type as its hash (uint64_t) and name.
+  inline std::string encode(const std::vector<MethodInfo> &table)
+  {
+    using namespace detail;
+    std::string out;
+    out.push_back(MARK);
+    out.push_back(VERSION);
+    put_u32(out, static_cast<uint32_t>(table.size()));
+    for (auto &r: table)
+    {
+      put_str(out, r.name);
+      put_u64(out, r.signature);
+      put_u64(out, r.ret);
+      put_str(out, r.ret_name);
+      put_u32(out, static_cast<uint32_t>(r.args.size()));
+      for (std::size_t i = 0; i < r.args.size(); ++i)
+      {
+        put_u64(out, r.args[i]);
+        put_str(out, r.arg_names[i]);
+      }
+    }
+    return out;
+  }
+  
+  inline std::vector<MethodInfo> decode_table(const std::string &str)
+  {
+    detail::Cursor cur(str);
+    cur.header();
+    std::vector<MethodInfo> table(cur.count(3 * sizeof(uint32_t) + 2 * sizeof(uint64_t)));
+    for (auto &r: table)
+    {
+      r.name = cur.str();
+      r.signature = cur.u64();
+      r.ret = cur.u64();
+      r.ret_name = cur.str();
+      auto n = cur.count(sizeof(uint64_t) + sizeof(uint32_t));
+      r.args.reserve(n);
+      r.arg_names.reserve(n);
+      for (uint32_t i = 0; i < n; ++i)
+      {
+        r.args.emplace_back(cur.u64());
+        r.arg_names.emplace_back(cur.str());
+      }
+    }
+    cur.finish();
+    return table;
+  }
+  
+  inline std::string to_czh(const Request &req)
+  {
+    czh::Node params;
+    if (req.kind == Kind::call)
+    {
+      params.add("id", req.id);
+      params.add("expected_ret", std::string(req.expected_ret.name));
+      params.add("args", method::param_to_czh(req.args));
+    }
+    else
+    {
+      params.add("batch", czh::value::Array(req.batch.begin(), req.batch.end()));
+    }
+    if (req.timeout != 0) params.add("timeout", static_cast<int>(req.timeout));
+    return utils::to_str(params);
+  }
+  
+  inline std::string to_czh(const Response &res)
+  {
+    czh::Node node;
+    if (res.status == Status::failed)
+    {
+      node.add("status", std::string("failed"));
+      node.add("message", res.message);
+      if (res.detail == Detail::expected_args)
+      {
+        node.add("expected_args", czh::value::Array(res.details.begin(), res.details.end()));
+      }
+      else if (res.detail != Detail::none)
+      {
+        node.add(detail::detail_keys[static_cast<uint8_t>(res.detail)], res.details.empty() ? "" : res.details[0]);
+      }
+    }
+    else
+    {
+      node.add("status", std::string("success"));
+      if (res.kind == Kind::call)
+      {
+        node.add("return", method::param_to_czh(res.ret));
+      }
+      else
+      {
+        node.add("batch", czh::value::Array(res.batch.begin(), res.batch.end()));
+      }
+    }
+    return utils::to_str(node);
+  }
+  
+  // A response as czh text, throws error::envelope::invalid_response if it isn't one.
+  inline Response response_from_czh(const czh::Node &node)
+  {
+    error::qwrpc_assert(node.has_node("status") && node["status"].is<std::string>(),
+                        error::envelope::invalid_response);
+    Response res;
+    if (node["status"].get<std::string>() != "success")
+    {
+      error::qwrpc_assert(node.has_node("message") && node["message"].is<std::string>(),
+                          error::envelope::invalid_response);
+      res.status = Status::failed;
+      res.message = node["message"].get<std::string>();
+      for (uint8_t i = 1; i < std::size(detail::detail_keys); ++i)
+      {
+        auto key = detail::detail_keys[i];
+        if (!node.has_node(key)) continue;
+        res.detail = static_cast<Detail>(i);
+        if (node[key].is<std::string>())
+        {
+          res.details.emplace_back(node[key].get<std::string>());
+        }
+        else if (node[key].get_value().template can_get<std::vector<std::string>>())
+        {
+          res.details = node[key].get<std::vector<std::string>>();
+        }
+        break;
+      }
+      return res;
+    }
+    if (node.has_node("batch"))
+    {
+      error::qwrpc_assert(node["batch"].is<czh::value::Array>()
+                          && node["batch"].get_value().template can_get<std::vector<std::string>>(),
+                          error::envelope::invalid_response);
+      res.kind = Kind::batch;
+      res.batch = node["batch"].get<std::vector<std::string>>();
+      return res;
+    }
+    error::qwrpc_assert(node.has_node("return") && node["return"].is<czh::value::Array>(),
+                        error::envelope::invalid_response);
+    error::qwrpc_assert(method::czh_to_param(node["return"].get<czh::value::Array>(), res.ret),
+                        error::envelope::invalid_response);
+    return res;
+  }
+}
+#endif
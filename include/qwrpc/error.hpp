@@ -81,5 +81,17 @@ namespace qwrpc::error
     }
   }
   
+  // Keeps the std::string for the detail off the hot path, it is only built if the assertion fails.
+  void qwrpc_assert(bool b,
+                    const char *detail_,
+                    const std::experimental::source_location &l =
+                    std::experimental::source_location::current())
+  {
+    if (!b)
+    {
+      throw Error(detail_, l);
+    }
+  }
+  
 }
 #endif
\ No newline at end of file
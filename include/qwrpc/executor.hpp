@@ -0,0 +1,419 @@
+//   Copyright 2023 qwrpc - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef QWRPC_EXECUTOR_HPP
+#define QWRPC_EXECUTOR_HPP
+#pragma once
+
+#include "error.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace qwrpc::error::executor
+{
+  constexpr auto stopped = "Can not add task on stopped Executor";
+}
+namespace qwrpc::executor
+{
+  // A move-only std::function<void()>. Callables of up to inline_size bytes are stored in place,
+  // so submitting them allocates nothing.
+  class Task
+  {
+  public:
+    // Fits the tasks of a request: the reactor, its connection, the request id, content and arrival time.
+    static constexpr std::size_t inline_size = 80;
+  private:
+    struct Ops
+    {
+      void (*call)(void *);
+      // Moves from src into the uninitialized dst and destroys src.
+      void (*move)(void *dst, void *src);
+      void (*destroy)(void *);
+    };
+    
+    template<typename F>
+    static constexpr bool fits = sizeof(F) <= inline_size && alignof(F) <= alignof(std::max_align_t)
+                                 && std::is_nothrow_move_constructible_v<F>;
+    
+    template<typename F>
+    static const Ops *ops_for()
+    {
+      if constexpr (fits<F>)
+      {
+        static constexpr Ops ops{
+            [](void *p) { (*static_cast<F *>(p))(); },
+            [](void *dst, void *src)
+            {
+              new(dst) F(std::move(*static_cast<F *>(src)));
+              static_cast<F *>(src)->~F();
+            },
+            [](void *p) { static_cast<F *>(p)->~F(); }};
+        return &ops;
+      }
+      else
+      {
+        static constexpr Ops ops{
+            [](void *p) { (**static_cast<F **>(p))(); },
+            [](void *dst, void *src) { *static_cast<F **>(dst) = *static_cast<F **>(src); },
+            [](void *p) { delete *static_cast<F **>(p); }};
+        return &ops;
+      }
+    }
+    
+    alignas(std::max_align_t) unsigned char storage[inline_size];
+    const Ops *ops;
+  public:
+    Task() : ops(nullptr) {}
+    
+    template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F &&f) : ops(ops_for<std::decay_t<F>>())
+    {
+      using D = std::decay_t<F>;
+      if constexpr (fits<D>)
+      {
+        new(storage) D(std::forward<F>(f));
+      }
+      else
+      {
+        *reinterpret_cast<D **>(storage) = new D(std::forward<F>(f));
+      }
+    }
+    
+    Task(Task &&other) noexcept: ops(other.ops)
+    {
+      if (ops != nullptr)
+      {
+        ops->move(storage, other.storage);
+        other.ops = nullptr;
+      }
+    }
+    
+    Task &operator=(Task &&other) noexcept
+    {
+      if (this != &other)
+      {
+        reset();
+        ops = other.ops;
+        if (ops != nullptr)
+        {
+          ops->move(storage, other.storage);
+          other.ops = nullptr;
+        }
+      }
+      return *this;
+    }
+    
+    Task(const Task &) = delete;
+    
+    ~Task() { reset(); }
+    
+    explicit operator bool() const { return ops != nullptr; }
+    
+    void operator()() { ops->call(storage); }
+    
+    void reset()
+    {
+      if (ops != nullptr)
+      {
+        ops->destroy(storage);
+        ops = nullptr;
+      }
+    }
+  };
+  
+  // A growable ring of Tasks. Its storage is kept when it drains, so a warmed-up queue doesn't allocate.
+  class TaskQueue
+  {
+  private:
+    std::vector<Task> buf;
+    std::size_t head;
+    std::size_t count;
+  public:
+    TaskQueue() : head(0), count(0) {}
+    
+    bool empty() const { return count == 0; }
+    
+    void push_back(Task &&task)
+    {
+      if (count == buf.size()) grow();
+      buf[(head + count) & (buf.size() - 1)] = std::move(task);
+      ++count;
+    }
+    
+    void pop_back(Task &task)
+    {
+      --count;
+      task = std::move(buf[(head + count) & (buf.size() - 1)]);
+    }
+    
+    void pop_front(Task &task)
+    {
+      task = std::move(buf[head]);
+      head = (head + 1) & (buf.size() - 1);
+      --count;
+    }
+  
+  private:
+    void grow()
+    {
+      std::vector<Task> bigger(std::max<std::size_t>(buf.size() * 2, 16));
+      for (std::size_t i = 0; i < count; ++i)
+      {
+        bigger[i] = std::move(buf[(head + i) & (buf.size() - 1)]);
+      }
+      buf.swap(bigger);
+      head = 0;
+    }
+  };
+  
+  // A work-stealing thread pool with the interface of connector::Thpool.
+  // Every worker has its own deque: it pushes and pops the tasks it spawns at the back, idle workers steal
+  // from the front of a random victim. Tasks from other threads are spread round-robin into a separate
+  // FIFO lane of each worker, so that requests still run in the order they arrived.
+  // Workers that find nothing anywhere park on a condition variable. A submitter only wakes one of them
+  // if nobody is already searching for work, and a searcher that finds some wakes the next one, so a burst
+  // of tasks ramps the workers up one by one instead of waking all of them for every task.
+  class Executor
+  {
+  private:
+    // On its own cache line, so that neighbouring queues don't bounce.
+    struct alignas(64) Queue
+    {
+      std::mutex mtx;
+      // Spawned by the worker itself, taken from the back by it.
+      TaskQueue local;
+      // Submitted by other threads, always taken from the front.
+      TaskQueue external;
+      
+      bool empty() const { return local.empty() && external.empty(); }
+    };
+    
+    std::unique_ptr<Queue[]> queues;
+    std::size_t size;
+    std::vector<std::thread> pool;
+    std::atomic<bool> run;
+    std::atomic<std::size_t> next;
+    // 0 means unbounded, `queued` is only maintained otherwise.
+    std::size_t max_queued;
+    std::atomic<std::size_t> queued;
+    std::mutex park_mtx;
+    std::condition_variable park_cond;
+    std::atomic<std::size_t> sleeping;
+    std::atomic<std::size_t> searching;
+    uint64_t wake_epoch;
+    
+    static inline thread_local const Executor *current = nullptr;
+    static inline thread_local std::size_t current_index = 0;
+  public:
+    // `max_queued_` only limits try_post(), everything else is always accepted.
+    explicit Executor(std::size_t size_, std::size_t max_queued_ = 0)
+        : queues(std::make_unique<Queue[]>(std::max<std::size_t>(size_, 1))),
+          size(std::max<std::size_t>(size_, 1)), run(true), next(0),
+          max_queued(max_queued_), queued(0), sleeping(0), searching(0), wake_epoch(0)
+    {
+      for (std::size_t i = 0; i < size; ++i)
+      {
+        pool.emplace_back([this, i] { work(i); });
+      }
+    }
+    
+    Executor(const Executor &) = delete;
+    
+    // Runs the tasks that are still queued, then joins.
+    ~Executor()
+    {
+      run = false;
+      {
+        std::lock_guard<std::mutex> lock(park_mtx);
+        ++wake_epoch;
+      }
+      park_cond.notify_all();
+      for (auto &th: pool)
+      {
+        if (th.joinable()) th.join();
+      }
+    }
+    
+    template<typename Func, typename... Args>
+    auto add_task(Func &&f, Args &&... args)
+    -> std::future<std::invoke_result_t<Func, Args...>>
+    {
+      error::qwrpc_assert(run, error::executor::stopped);
+      using ret_type = std::invoke_result_t<Func, Args...>;
+      auto task = std::make_shared<std::packaged_task<ret_type() >>
+          (std::bind(std::forward<Func>(f),
+                     std::forward<Args>(args)...));
+      std::future<ret_type> ret = task->get_future();
+      push([task] { (*task)(); });
+      return ret;
+    }
+    
+    // Fire and forget: no future and no shared state. Small callables don't allocate at all.
+    // Exceptions escaping `f` terminate, like in a std::thread.
+    template<typename Func>
+    void post(Func &&f)
+    {
+      error::qwrpc_assert(run, error::executor::stopped);
+      push(Task(std::forward<Func>(f)));
+    }
+    
+    // Like post(), but returns false instead if `max_queued` tasks are already waiting.
+    // Concurrent callers may overshoot the limit by a few.
+    template<typename Func>
+    bool try_post(Func &&f)
+    {
+      if (max_queued != 0 && queued.load(std::memory_order_relaxed) >= max_queued) return false;
+      post(std::forward<Func>(f));
+      return true;
+    }
+    
+    std::size_t get_queued() const { return queued.load(std::memory_order_relaxed); }
+    
+    std::size_t get_size() const { return size; }
+  
+  private:
+    void push(Task &&task)
+    {
+      // A worker keeps what it spawns, others steal it if they run dry.
+      bool local = current == this;
+      auto index = local ? current_index : next.fetch_add(1, std::memory_order_relaxed) % size;
+      if (max_queued != 0) queued.fetch_add(1, std::memory_order_relaxed);
+      {
+        std::lock_guard<std::mutex> lock(queues[index].mtx);
+        (local ? queues[index].local : queues[index].external).push_back(std::move(task));
+      }
+      // Pairs with the fence in work(): either the parking worker sees the task, or we see it parking.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (searching.load(std::memory_order_relaxed) == 0)
+      {
+        wake_one();
+      }
+    }
+    
+    void wake_one()
+    {
+      if (sleeping.load(std::memory_order_relaxed) == 0) return;
+      {
+        std::lock_guard<std::mutex> lock(park_mtx);
+        ++wake_epoch;
+      }
+      park_cond.notify_one();
+    }
+    
+    bool pop(std::size_t index, Task &task)
+    {
+      auto &q = queues[index];
+      std::lock_guard<std::mutex> lock(q.mtx);
+      if (q.empty()) return false;
+      // What it spawned continues what the worker is doing, the oldest request comes right after.
+      if (!q.local.empty()) q.local.pop_back(task);
+      else q.external.pop_front(task);
+      if (max_queued != 0) queued.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+    
+    bool steal(std::size_t thief, uint64_t &seed, Task &task)
+    {
+      // xorshift, only used to pick where to start.
+      seed ^= seed << 13;
+      seed ^= seed >> 7;
+      seed ^= seed << 17;
+      auto start = seed % size;
+      for (std::size_t i = 0; i < size; ++i)
+      {
+        auto victim = (start + i) % size;
+        if (victim == thief) continue;
+        auto &q = queues[victim];
+        std::lock_guard<std::mutex> lock(q.mtx);
+        if (q.empty()) continue;
+        if (!q.external.empty()) q.external.pop_front(task);
+        else q.local.pop_front(task);
+        if (max_queued != 0) queued.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      }
+      return false;
+    }
+    
+    void work(std::size_t index)
+    {
+      current = this;
+      current_index = index;
+      uint64_t seed = index * 0x9e3779b97f4a7c15ull + 1;
+      Task task;
+      bool is_searching = false;
+      while (true)
+      {
+        if (pop(index, task))
+        {
+          task();
+          task.reset();
+          continue;
+        }
+        if (!is_searching)
+        {
+          is_searching = true;
+          searching.fetch_add(1, std::memory_order_seq_cst);
+        }
+        if (steal(index, seed, task))
+        {
+          is_searching = false;
+          // The last searcher hands the search over, there may be more where this came from.
+          if (searching.fetch_sub(1, std::memory_order_seq_cst) == 1)
+          {
+            wake_one();
+          }
+          task();
+          task.reset();
+          continue;
+        }
+        uint64_t epoch;
+        {
+          std::lock_guard<std::mutex> lock(park_mtx);
+          epoch = wake_epoch;
+          sleeping.fetch_add(1, std::memory_order_relaxed);
+        }
+        is_searching = false;
+        searching.fetch_sub(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // Look once more after announcing, a task pushed meanwhile would otherwise be missed.
+        if (pop(index, task) || steal(index, seed, task))
+        {
+          sleeping.fetch_sub(1, std::memory_order_relaxed);
+          task();
+          task.reset();
+          continue;
+        }
+        if (!run)
+        {
+          sleeping.fetch_sub(1, std::memory_order_relaxed);
+          return;
+        }
+        std::unique_lock<std::mutex> lock(park_mtx);
+        park_cond.wait(lock, [this, epoch] { return wake_epoch != epoch; });
+        sleeping.fetch_sub(1, std::memory_order_relaxed);
+      }
+    }
+  };
+}
+#endif
@@ -18,7 +18,10 @@
 #include "error.hpp"
 #include <string>
 #include <iostream>
+#include <fstream>
 #include <memory>
+#include <chrono>
+#include <thread>
 #include <experimental/source_location>
 
 namespace qwrpc::logger
@@ -17,12 +17,22 @@
 
 #include "error.hpp"
 #include "serializer.hpp"
+#include "coro.hpp"
 #include "libczh/czh.hpp"
+#include <cstdint>
+#include <string_view>
 #include <vector>
 #include <tuple>
 #include <functional>
 #include <variant>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <thread>
 
 namespace qwrpc::method
 {
@@ -128,12 +138,59 @@ namespace qwrpc::method
     return str.substr(b + 1, e - b - 1);
   }
   
+  // FNV-1a.
+  constexpr uint64_t type_hash(std::string_view name)
+  {
+    uint64_t ret = 0xcbf29ce484222325ull;
+    for (auto c: name)
+    {
+      ret ^= static_cast<unsigned char>(c);
+      ret *= 0x100000001b3ull;
+    }
+    return ret;
+  }
+  
+  template<typename T>
+  consteval uint64_t qwrpc_type_hash()
+  {
+    return type_hash(qwrpc_type_id<T>());
+  }
+  
+  // A type as calls carry it. Types are told apart by the hash alone, the name is there for czh envelopes
+  // and error messages. It is empty for types read from a binary envelope or a peer's czh.
+  struct TypeId
+  {
+    uint64_t hash = 0;
+    std::string_view name;
+    
+    bool operator==(const TypeId &other) const { return hash == other.hash; }
+  };
+  
+  template<typename T>
+  consteval TypeId qwrpc_type()
+  {
+    return {qwrpc_type_hash<T>(), qwrpc_type_id<T>()};
+  }
+  
+  constexpr uint64_t combine_hash(uint64_t seed, uint64_t hash)
+  {
+    return seed ^ (hash + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+  }
+  
+  // The return type and the argument types of a call in one hash.
+  template<typename Ret, typename ...Args>
+  consteval uint64_t signature_hash()
+  {
+    uint64_t ret = qwrpc_type_hash<Ret>();
+    ((ret = combine_hash(ret, qwrpc_type_hash<Args>())), ...);
+    return ret;
+  }
   
   class Data
   {
   private:
     std::string data;
-    std::string type;
+    TypeId type;
   public:
     Data() = default;
     
@@ -141,7 +198,7 @@ namespace qwrpc::method
     requires (!std::is_base_of_v<Data, std::decay_t<T>>)
     T as()
     {
-      error::qwrpc_assert(qwrpc_type_id<T>() == type, "Get error type.");
+      error::qwrpc_assert(qwrpc_type_hash<T>() == type.hash, "Get error type.");
       if constexpr(std::is_same_v<T, void>)
       {
         return;
@@ -154,15 +211,81 @@ namespace qwrpc::method
   
     template<typename T>
     requires (!std::is_base_of_v<Data, std::decay_t<T>>)
-    Data(T &&value): data(serializer::serialize(std::forward<T>(value))), type(qwrpc_type_id<std::decay_t<T>>()) {}
+    Data(T &&value): data(serializer::serialize(std::forward<T>(value))), type(qwrpc_type<std::decay_t<T>>()) {}
     
-    Data(std::string str, std::string type) : data(std::move(str)), type(std::move(type)) {}
+    Data(std::string str, TypeId type) : data(std::move(str)), type(type) {}
+  
+    const TypeId &get_type() const { return type; }
+  
+    const std::string &get_data() const { return data; }
+  };
   
-    std::string get_type() const { return type; }
+  // How a call reaches its streams and its caller, empty for ordinary calls.
+  struct Streams
+  {
+    // Where the items of a streaming method go.
+    std::function<void(Data &&)> sink;
+    // Where the items of a client-streaming method come from, returns false at the end.
+    std::function<bool(std::string &)> source;
+    // Whether the caller cancelled the call or its deadline has passed.
+    std::function<bool()> cancelled;
+    
+    bool is_cancelled() const { return cancelled != nullptr && cancelled(); }
+  };
   
-    std::string get_data() const { return data; }
+  // The first parameter of a method that wants to stop early once nobody waits for its result anymore.
+  // It doesn't count as an argument of the call.
+  class CancelToken
+  {
+  private:
+    const Streams &streams;
+  public:
+    explicit CancelToken(const Streams &streams_) : streams(streams_) {}
+    
+    // True once the caller cancelled the call or its deadline has passed. Cheap enough to poll in a loop.
+    bool cancelled() const { return streams.is_cancelled(); }
   };
   
+  // The first parameter of a streaming method. Every write() sends one item to the caller right away.
+  template<typename T>
+  class Writer
+  {
+  private:
+    const Streams &streams;
+  public:
+    explicit Writer(const Streams &streams_) : streams(streams_) {}
+    
+    void write(const T &item) { streams.sink(Data(item)); }
+    
+    // Like CancelToken::cancelled(), nobody reads the items anymore.
+    bool cancelled() const { return streams.is_cancelled(); }
+  };
+  
+  // The first parameter of a client-streaming method. read() blocks for the next item the caller sends
+  // and returns false once the caller has finished.
+  template<typename T>
+  class Reader
+  {
+  private:
+    const Streams &streams;
+  public:
+    explicit Reader(const Streams &streams_) : streams(streams_) {}
+    
+    bool read(T &item)
+    {
+      std::string data;
+      if (!streams.source(data)) return false;
+      item = serializer::deserialize<T>(data);
+      return true;
+    }
+    
+    // Like CancelToken::cancelled(). A cancelled call gets no more items, read() returns false.
+    bool cancelled() const { return streams.is_cancelled(); }
+  };
+  
+  // What a method does besides returning, recorded when it is registered.
+  enum class StreamKind { none, writer, reader };
+  
   template<class... Ts>
   struct overloaded : Ts ...
   {
@@ -176,52 +299,64 @@ namespace qwrpc::method
     if (param.empty()) return {};
     error::qwrpc_assert(param.size() == 1);
     czh::value::Array ret;
-    ret.emplace_back(param[0].get_type());
+    ret.emplace_back(std::string(param[0].get_type().name));
     ret.emplace_back(param[0].get_data());
     return ret;
   }
   
   template<typename T>
-  T ret_get(const czh::value::Array &ret)
-  {
-    error::qwrpc_assert(ret.size() == 2);
-    error::qwrpc_assert(ret[0].index()
-                        == czh::value::details::index_of_v<std::string,
-        czh::value::details::BasicVTList>);
-    error::qwrpc_assert(std::get<std::string>(ret[0]) == qwrpc_type_id<T>());
-    error::qwrpc_assert(ret[1].index()
-                        == czh::value::details::index_of_v<std::string,
-        czh::value::details::BasicVTList>);
-    return Data(std::get<std::string>(ret[1]), std::string(qwrpc_type_id<T>())).as<T>();
+  T ret_get(const MethodParam &ret)
+  {
+    error::qwrpc_assert(ret.size() == 1);
+    error::qwrpc_assert(ret[0].get_type().hash == qwrpc_type_hash<T>());
+    return Data(ret[0]).as<T>();
   }
   
   template<>
-  void ret_get(const czh::value::Array &ret)
+  void ret_get(const MethodParam &ret)
   {
     error::qwrpc_assert(ret.empty());
   }
   
   template<typename ...Args>
-  auto args_to_czh_array(Args &&...args)
+  MethodParam args_to_param(Args &&...args)
+  {
+    return MethodParam{static_cast<Data>(args)...};
+  }
+  
+  // Data -> std::string[type name] + std::string[data], the way czh envelopes carry it.
+  inline czh::value::Array param_to_czh(const MethodParam &param)
   {
-    auto tmp = std::make_tuple(args...);
-    // make tuple a MethodParam
-    auto param = std::apply([](auto &&... elems)
-                            {
-                              return MethodParam{static_cast<Data>(elems)...};
-                            }, tmp);
-    
-    // convert MethodParam to czh array
     czh::value::Array ret;
     for (auto &r: param)
     {
-      // Data -> std::string[type] + std::string[data]
-      ret.emplace_back(r.get_type());
+      ret.emplace_back(std::string(r.get_type().name));
       ret.emplace_back(r.get_data());
     }
     return ret;
   }
   
+  // The other way round, false if `arr` isn't made of such pairs.
+  inline bool czh_to_param(const czh::value::Array &arr, MethodParam &param)
+  {
+    if (arr.size() % 2 != 0) return false;
+    constexpr auto string_index = czh::value::details::index_of_v<std::string, czh::value::details::BasicVTList>;
+    param.clear();
+    param.reserve(arr.size() / 2);
+    for (std::size_t i = 0; i < arr.size(); i += 2)
+    {
+      if (arr[i].index() != string_index || arr[i + 1].index() != string_index) return false;
+      param.emplace_back(std::get<std::string>(arr[i + 1]), TypeId{type_hash(std::get<std::string>(arr[i])), {}});
+    }
+    return true;
+  }
+  
+  template<typename ...Args>
+  auto args_to_czh_array(Args &&...args)
+  {
+    return param_to_czh(args_to_param(std::forward<Args>(args)...));
+  }
+  
   template<typename F, typename List, std::size_t... index>
   auto call_with_param_helper(const F &func, const MethodParam &v, std::index_sequence<index...>)
   {
@@ -264,29 +399,132 @@ namespace qwrpc::method
         (std::forward<F>(func), v, std::make_index_sequence<sizeof...(Args)>());
   }
   
+  // Completes a call of an asynchronous method with its result, or with the exception it threw.
+  using Done = std::function<void(MethodParam &&, std::exception_ptr)>;
+  
+  template<typename Ret>
+  coro::Task<void> complete_task(coro::Task<Ret> task, Done done)
+  {
+    MethodParam ret;
+    try
+    {
+      if constexpr(std::is_same_v<Ret, void>)
+      {
+        co_await task;
+      }
+      else
+      {
+        ret.emplace_back(co_await task);
+      }
+    }
+    catch (...)
+    {
+      done({}, std::current_exception());
+      co_return;
+    }
+    done(std::move(ret), nullptr);
+  }
+  
+  // Waits for the futures returned by asynchronous methods. A std::future can't notify anyone,
+  // so one thread polls all of them, it is started with the first one.
+  class FutureWaiter
+  {
+  public:
+    // Returns true once the future was ready and its result passed on.
+    using Poll = std::function<bool()>;
+  private:
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::vector<Poll> polls;
+    bool run;
+    std::thread th;
+  public:
+    FutureWaiter() : run(true) {}
+    
+    FutureWaiter(const FutureWaiter &) = delete;
+    
+    // Futures still pending are dropped.
+    ~FutureWaiter()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        run = false;
+      }
+      cond.notify_one();
+      if (th.joinable()) th.join();
+    }
+    
+    void add(Poll &&poll)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        polls.emplace_back(std::move(poll));
+        if (!th.joinable()) th = std::thread([this] { loop(); });
+      }
+      cond.notify_one();
+    }
+  
+  private:
+    void loop()
+    {
+      // Doubled while nothing becomes ready, so that a slow future costs few passes and
+      // a fast one is not delayed by more than it has already waited.
+      constexpr std::chrono::microseconds min_backoff{20};
+      constexpr std::chrono::microseconds max_backoff{8000};
+      std::vector<Poll> pending;
+      auto backoff = min_backoff;
+      while (true)
+      {
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          if (pending.empty())
+            cond.wait(lock, [this] { return !run || !polls.empty(); });
+          else if (cond.wait_for(lock, backoff, [this] { return !run || !polls.empty(); }))
+            backoff = min_backoff;
+          else
+            backoff = std::min(backoff * 2, max_backoff);
+          if (!run) return;
+          std::move(polls.begin(), polls.end(), std::back_inserter(pending));
+          polls.clear();
+        }
+        auto before = pending.size();
+        std::erase_if(pending, [](Poll &poll) { return poll(); });
+        if (pending.size() != before) backoff = min_backoff;
+      }
+    }
+  };
+  
   template<typename ...Args>
   auto make_index()
   {
-    // CustomType -> -1
-    return std::vector<std::string>{
-        {
-            std::string(qwrpc_type_id<std::decay_t<Args>>())
-        }...};
+    return std::vector<TypeId>{qwrpc_type<std::decay_t<Args>>()...};
+  }
+  
+  // The signature_hash() of what a call asks for.
+  inline uint64_t signature_of(const TypeId &ret, const MethodParam &args)
+  {
+    auto sig = ret.hash;
+    for (auto &r: args) sig = combine_hash(sig, r.get_type().hash);
+    return sig;
   }
   
   class Method
   {
   private:
-    std::function<MethodParam(MethodParam)> func;
-    std::vector<std::string> args;
-    std::string ret_type;
+    std::function<MethodParam(MethodParam, const Streams &)> func;
+    // Set instead of func for asynchronous methods.
+    std::function<void(MethodParam, const Done &, FutureWaiter &)> async_func;
+    std::vector<TypeId> args;
+    TypeId ret_type;
+    uint64_t signature = 0;
+    StreamKind stream = StreamKind::none;
   public:
     Method() = default;
   
     template<MethodArgRetType ...Args, MethodArgRetType Ret>
     Method(std::function<Ret(Args...)> f)
         :args(make_index<std::decay_t<Args>...>()),
-         func([f](MethodParam call_args)
+         func([f](MethodParam call_args, const Streams &)
               {
                 if constexpr(std::is_same_v<std::decay_t<Ret>, void>)
                 {
@@ -298,24 +536,149 @@ namespace qwrpc::method
                   return call_with_param<std::decay_t<Args>...>(f, call_args);
                 }
               }),
-         ret_type(qwrpc_type_id<Ret>()) {}
+         ret_type(qwrpc_type<Ret>()),
+         signature(signature_hash<Ret, std::decay_t<Args>...>()) {}
+    
+    template<MethodArgRetType Ret, MethodArgRetType ...Args>
+    Method(std::function<Ret(const CancelToken &, Args...)> f)
+        : func([f](MethodParam call_args, const Streams &streams)
+               {
+                 CancelToken token(streams);
+                 auto with_token = [&f, &token](auto &&... elems)
+                 {
+                   return f(token, std::forward<decltype(elems)>(elems)...);
+                 };
+                 if constexpr(std::is_same_v<std::decay_t<Ret>, void>)
+                 {
+                   call_with_param_void<std::decay_t<Args>...>(with_token, call_args);
+                   return MethodParam{};
+                 }
+                 else
+                 {
+                   return call_with_param<std::decay_t<Args>...>(with_token, call_args);
+                 }
+               }),
+          args(make_index<std::decay_t<Args>...>()),
+          ret_type(qwrpc_type<Ret>()),
+          signature(signature_hash<Ret, std::decay_t<Args>...>()) {}
+    
+    // A streaming method returns nothing itself, callers expect Writer<Item> instead.
+    template<MethodArgRetType Item, MethodArgRetType ...Args>
+    Method(std::function<void(Writer<Item> &, Args...)> f)
+        : func([f](MethodParam call_args, const Streams &streams)
+               {
+                 Writer<Item> writer(streams);
+                 call_with_param_void<std::decay_t<Args>...>(
+                     [&f, &writer](auto &&... elems) { f(writer, std::forward<decltype(elems)>(elems)...); },
+                     call_args);
+                 return MethodParam{};
+               }),
+          args(make_index<std::decay_t<Args>...>()),
+          ret_type(qwrpc_type<Writer<Item>>()),
+          signature(signature_hash<Writer<Item>, std::decay_t<Args>...>()),
+          stream(StreamKind::writer) {}
     
-    bool check_args(const czh::value::Array &call_args) const
+    // The Reader counts as the first argument, so that only callers that stream can call it.
+    // Its slot carries no data.
+    template<MethodArgRetType Ret, MethodArgRetType Item, MethodArgRetType ...Args>
+    Method(std::function<Ret(Reader<Item> &, Args...)> f)
+        : func([f](MethodParam call_args, const Streams &streams)
+               {
+                 Reader<Item> reader(streams);
+                 call_args.erase(call_args.begin());
+                 auto with_reader = [&f, &reader](auto &&... elems)
+                 {
+                   return f(reader, std::forward<decltype(elems)>(elems)...);
+                 };
+                 if constexpr(std::is_same_v<std::decay_t<Ret>, void>)
+                 {
+                   call_with_param_void<std::decay_t<Args>...>(with_reader, call_args);
+                   return MethodParam{};
+                 }
+                 else
+                 {
+                   return call_with_param<std::decay_t<Args>...>(with_reader, call_args);
+                 }
+               }),
+          args(make_index<Reader<Item>, std::decay_t<Args>...>()),
+          ret_type(qwrpc_type<Ret>()),
+          signature(signature_hash<Ret, Reader<Item>, std::decay_t<Args>...>()),
+          stream(StreamKind::reader) {}
+    
+    // An asynchronous method. Its task runs on the worker until it first suspends, and then on whatever
+    // resumes it, no thread waits for it. Parameters must be taken by value, the task outlives the call.
+    template<MethodArgRetType Ret, MethodArgRetType ...Args>
+    Method(std::function<coro::Task<Ret>(Args...)> f)
+        : async_func([f](MethodParam call_args, const Done &done, FutureWaiter &)
+                     {
+                       coro::spawn(complete_task(
+                           call_with_param_helper<decltype(f), TypeList<std::decay_t<Args>...>>(
+                               f, call_args, std::make_index_sequence<sizeof...(Args)>()), done));
+                     }),
+          args(make_index<std::decay_t<Args>...>()),
+          ret_type(qwrpc_type<Ret>()),
+          signature(signature_hash<Ret, std::decay_t<Args>...>())
+    {
+      static_assert((!std::is_reference_v<Args> && ...), "Parameters of a coroutine method must be values.");
+    }
+    
+    // An asynchronous method returning a std::future, the FutureWaiter passes its result on.
+    template<MethodArgRetType Ret, MethodArgRetType ...Args>
+    Method(std::function<std::future<Ret>(Args...)> f)
+        : async_func([f](MethodParam call_args, const Done &done, FutureWaiter &waiter)
+                     {
+                       auto future = std::make_shared<std::future<Ret>>(
+                           call_with_param_helper<decltype(f), TypeList<std::decay_t<Args>...>>(
+                               f, call_args, std::make_index_sequence<sizeof...(Args)>()));
+                       auto poll = [future, done]
+                       {
+                         if (future->wait_for(std::chrono::seconds(0)) == std::future_status::timeout) return false;
+                         MethodParam ret;
+                         try
+                         {
+                           if constexpr(std::is_same_v<Ret, void>)
+                           {
+                             future->get();
+                           }
+                           else
+                           {
+                             ret.emplace_back(future->get());
+                           }
+                         }
+                         catch (...)
+                         {
+                           done({}, std::current_exception());
+                           return true;
+                         }
+                         done(std::move(ret), nullptr);
+                         return true;
+                       };
+                       // A deferred one only runs when asked for, so it may as well run here.
+                       if (future->wait_for(std::chrono::seconds(0)) == std::future_status::deferred)
+                       {
+                         poll();
+                         return;
+                       }
+                       waiter.add(std::move(poll));
+                     }),
+          args(make_index<std::decay_t<Args>...>()),
+          ret_type(qwrpc_type<Ret>()),
+          signature(signature_hash<Ret, std::decay_t<Args>...>()) {}
+    
+    // Whether a call asking for `ret` with `call_args` matches, one compare of the signatures.
+    // The count is checked as well, the hashes come from the peer.
+    bool check(const TypeId &ret, const MethodParam &call_args) const
     {
-      if (call_args.size() % 2 != 0) return false;
-      if (call_args.size() / 2 != args.size()) return false;
+      return call_args.size() == args.size() && signature_of(ret, call_args) == signature;
+    }
+    
+    // check_args() and check_ret() tell what didn't match.
+    bool check_args(const MethodParam &call_args) const
+    {
+      if (call_args.size() != args.size()) return false;
       for (size_t i = 0; i < args.size(); i++)
       {
-        if (call_args[i * 2].index() != czh::value::details::index_of_v<std::string, czh::value::details::BasicVTList>)
-        {
-          return false;
-        }
-        if (call_args[i * 2 + 1].index() !=
-            czh::value::details::index_of_v<std::string, czh::value::details::BasicVTList>)
-        {
-          return false;
-        }
-        if (std::get<std::string>(call_args[i * 2]) != args[i])
+        if (call_args[i].get_type().hash != args[i].hash)
         {
           return false;
         }
@@ -323,36 +686,51 @@ namespace qwrpc::method
       return true;
     }
   
-    bool check_ret(const std::string &ret) const
+    bool check_ret(const TypeId &ret) const
     {
-      return ret == ret_type;
+      return ret.hash == ret_type.hash;
     }
     
-    MethodParam call(const czh::value::Array &call_args) const
+    MethodParam call(MethodParam call_args, const Streams &streams = {}) const
     {
-      MethodParam internal_args;
-      for (size_t i = 0; i < call_args.size(); i += 2)
-      {
-        Data data(std::get<std::string>(call_args[i + 1]), std::get<std::string>(call_args[i]));
-        internal_args.emplace_back(std::move(data));
-      }
-      return func(std::move(internal_args));
+      return func(std::move(call_args), streams);
     }
     
-    czh::value::Array expected_args() const
+    bool is_async() const { return async_func != nullptr; }
+    
+    StreamKind get_stream_kind() const { return stream; }
+    
+    // Starts a call of an asynchronous method and returns, `done` is called once it has finished.
+    void call_async(MethodParam call_args, const Done &done, FutureWaiter &waiter) const
     {
-      czh::value::Array ret;
-      for (auto &r: args)
+      try
       {
-        ret.emplace_back(r);
+        async_func(std::move(call_args), done, waiter);
       }
+      catch (...)
+      {
+        done({}, std::current_exception());
+      }
+    }
+    
+    // The full names, for error messages.
+    std::vector<std::string> expected_args() const
+    {
+      std::vector<std::string> ret;
+      for (auto &r: args) ret.emplace_back(r.name);
       return ret;
     }
     
     std::string expected_ret() const
     {
-      return ret_type;
+      return std::string(ret_type.name);
     }
+    
+    const std::vector<TypeId> &get_args() const { return args; }
+    
+    const TypeId &get_ret() const { return ret_type; }
+    
+    uint64_t get_signature() const { return signature; }
   };
 }
 #endif
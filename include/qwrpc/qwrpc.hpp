@@ -15,12 +15,18 @@
 #define QWRPC_QWRPC_HPP
 #pragma once
 
+#include "compress.hpp"
 #include "connector.hpp"
+#include "coro.hpp"
+#include "envelope.hpp"
 #include "error.hpp"
+#include "executor.hpp"
 #include "method.hpp"
 #include "rpc_client.hpp"
 #include "rpc_server.hpp"
 #include "serializer.hpp"
+#include "shm.hpp"
+#include "uring.hpp"
 #include "utils.hpp"
 
 namespace qwrpc
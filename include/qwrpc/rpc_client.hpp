@@ -18,37 +18,415 @@
 #include "connector.hpp"
 #include "rpc_server.hpp"
 #include "method.hpp"
+#include "envelope.hpp"
 #include "utils.hpp"
 #include "libczh/czh.hpp"
 #include "error.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
 #include <future>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
+namespace qwrpc::error::rpc_client
+{
+  constexpr auto batch_not_called = "The batch has not been called yet.";
+}
 namespace qwrpc::rpc_client
 {
   class RpcClient
   {
   private:
-    std::string addr;
-    int port;
-    connector::Client cli;
+    connector::ClientPool pool;
   public:
-    RpcClient(const std::string &addr_, int port_) : addr(addr_), port(port_)
+    // The sending half of a client-streaming call, see open_stream().
+    template<typename Ret, typename Item>
+    class Upload
     {
-      cli.connect(addr_, port_);
-    }
-  
+    private:
+      std::shared_ptr<connector::Client> cli;
+      uint64_t id;
+      std::future<std::string> res;
+      bool finished;
+    public:
+      Upload(std::shared_ptr<connector::Client> cli_, uint64_t id_, std::future<std::string> res_)
+          : cli(std::move(cli_)), id(id_), res(std::move(res_)), finished(false) {}
+      
+      Upload(Upload &&) = default;
+      
+      // Ends the stream if finish() wasn't called, the result is dropped.
+      ~Upload()
+      {
+        if (cli != nullptr && !finished) cli->finish_upload(id);
+      }
+      
+      // Blocks while the server is too far behind. Returns false if the server has already answered,
+      // finish() then returns its answer.
+      // Throws error::connector::stream_item_too_large, without sending anything, if `item` serializes to
+      // more than connector::MAX_STREAM_ITEM bytes (2 MB): the server only hands out credit for whole items
+      // as its handler reads them, so a larger one might never fit. Split such data into several items.
+      bool write(const Item &item)
+      {
+        return cli->upload(id, serializer::serialize(item));
+      }
+      
+      Ret finish()
+      {
+        finished = true;
+        cli->finish_upload(id);
+        return parse_response<Ret>(res.get());
+      }
+    };
+    
+    // What call_co() returns, co_await it once.
+    template<typename Ret>
+    class CoCall
+    {
+    private:
+      std::shared_ptr<connector::Client> cli;
+      std::string request;
+      std::chrono::milliseconds timeout;
+      std::string response;
+      std::exception_ptr err;
+      std::coroutine_handle<> waiting;
+      // Whichever of await_suspend() and the response comes second resumes the coroutine.
+      std::atomic<bool> arrived;
+    public:
+      CoCall(std::shared_ptr<connector::Client> cli_, std::string request_, std::chrono::milliseconds timeout_)
+          : cli(std::move(cli_)), request(std::move(request_)), timeout(timeout_), arrived(false) {}
+      
+      bool await_ready() const noexcept { return false; }
+      
+      bool await_suspend(std::coroutine_handle<> waiting_)
+      {
+        waiting = waiting_;
+        connector::Client::Callback cb = [this](std::string &&res, std::exception_ptr e)
+        {
+          response = std::move(res);
+          err = e;
+          if (arrived.exchange(true)) waiting.resume();
+        };
+        if (timeout.count() == 0)
+          cli->async_send(request, std::move(cb));
+        else
+          cli->async_send_until(request, std::move(cb), std::chrono::steady_clock::now() + timeout);
+        // The response may already be here, the coroutine then goes on right away.
+        return !arrived.exchange(true);
+      }
+      
+      Ret await_resume()
+      {
+        if (err) std::rethrow_exception(err);
+        return parse_response<Ret>(response);
+      }
+    };
+    
+    // Calls collected for call_batch(), which sends all of them in one request.
+    class Batch
+    {
+    public:
+      // The result of one call of the batch, get() it after call_batch(). Every call has its own status,
+      // so get() throws just like call() would if that one failed.
+      template<typename Ret>
+      class Item
+      {
+      private:
+        const Batch *batch;
+        std::size_t index;
+      public:
+        Item(const Batch *batch_, std::size_t index_) : batch(batch_), index(index_) {}
+        
+        Ret get() const
+        {
+          error::qwrpc_assert(index < batch->responses.size(), error::rpc_client::batch_not_called);
+          return parse_response<Ret>(batch->responses[index]);
+        }
+      };
+    
+    private:
+      friend class RpcClient;
+      // Encoded once the connection, and so the form of the envelope, is known.
+      std::vector<envelope::Request> requests;
+      std::vector<std::string> responses;
+    public:
+      template<typename Ret, typename ...Args>
+      Item<Ret> add(const std::string &method_id, Args &&... args)
+      {
+        // The batch has one deadline for all of them.
+        requests.emplace_back(make_request<Ret>(std::chrono::milliseconds(0), method_id, std::forward<Args>(args)...));
+        return {this, requests.size() - 1};
+      }
+      
+      std::size_t size() const { return requests.size(); }
+    };
+    
+    // connector::Addr::unix_socket(path) connects over a Unix domain socket.
+    RpcClient(const connector::Addr &addr, const connector::ClientConfig &config = {})
+        : pool(addr, config) {}
+    
+    RpcClient(const std::string &addr_, int port_, const connector::ClientConfig &config = {})
+        : RpcClient(connector::Addr{addr_, port_}, config) {}
+    
+    // `connections` > 1 spreads the calls over that many connections.
+    RpcClient(const std::string &addr_, int port_, std::size_t connections)
+        : RpcClient(addr_, port_, connector::ClientConfig{.connections = connections}) {}
+    
+    // Gives up after ClientConfig::timeout, if there is one.
     template<typename Ret, typename ...Args>
     Ret call(const std::string &method_id, Args &&... args)
     {
-      auto internal_args = method::args_to_czh_array(args...);
-      czh::Node params
+      return call_for<Ret>(pool.get_config().timeout, method_id, std::forward<Args>(args)...);
+    }
+    
+    // Like call(), but throws error::connector::timed_out if there is no response within `timeout`,
+    // 0 means no limit. The call is cancelled then, the server learns the deadline too.
+    template<typename Ret, typename ...Args>
+    Ret call_for(std::chrono::milliseconds timeout, const std::string &method_id, Args &&... args)
+    {
+      auto cli = pool.get();
+      auto request = encode(*cli, make_request<Ret>(timeout, method_id, std::forward<Args>(args)...));
+      return parse_response<Ret>(send(*cli, request, timeout));
+    }
+    
+    // get() throws error::connector::timed_out once ClientConfig::timeout has passed since the call.
+    template<typename Ret, typename ...Args>
+    std::future<Ret> async_call(const std::string &method_id, Args &&... args)
+    {
+      // The call shares the connection with the others, the response is parsed by whoever get()s the future.
+      auto timeout = pool.get_config().timeout;
+      auto cli = pool.get();
+      uint64_t id;
+      auto res = cli->async_send(encode(*cli, make_request<Ret>(timeout, method_id, std::forward<Args>(args)...)), id);
+      return std::async(std::launch::deferred,
+                        [cli, id, res = std::move(res), timeout, deadline = Clock::now() + timeout]() mutable
+                        {
+                          if (timeout.count() == 0) return parse_response<Ret>(res.get());
+                          return parse_response<Ret>(cli->wait_until(res, id, deadline));
+                        });
+    }
+    
+    // co_await it in a coroutine. The call shares the connection with the others and no thread waits for it:
+    // the coroutine is suspended, and resumed on the reader thread of the connection when the response
+    // arrives. So don't block there until the coroutine suspends again, e.g. with call(), or other responses
+    // on that connection wait.
+    // Throws error::connector::timed_out once ClientConfig::timeout has passed. The one timer thread of the
+    // process only notices that, the coroutine is then resumed on the reader thread of the connection too.
+    template<typename Ret, typename ...Args>
+    CoCall<Ret> call_co(const std::string &method_id, Args &&... args)
+    {
+      auto cli = pool.get();
+      auto timeout = pool.get_config().timeout;
+      auto request = encode(*cli, make_request<Ret>(timeout, method_id, std::forward<Args>(args)...));
+      return {std::move(cli), std::move(request), timeout};
+    }
+    
+    // Sends all calls of `batch` in one frame and returns once all of them are answered, in one frame too.
+    // Their results are read through the Items batch.add() returned. Streaming methods can't be batched.
+    void call_batch(Batch &batch)
+    {
+      call_batch(batch, pool.get_config().timeout);
+    }
+    
+    // The deadline is the batch's, see call_for().
+    void call_batch(Batch &batch, std::chrono::milliseconds timeout)
+    {
+      auto cli = pool.get();
+      envelope::Request request;
+      request.kind = envelope::Kind::batch;
+      request.timeout = wire_timeout(timeout);
+      for (auto &r: batch.requests)
+      {
+        // Calls that don't match the method table go by name, the server answers them with their own status.
+        request.batch.emplace_back(encode(*cli, envelope::Request(r), false));
+      }
+      auto response = parse_envelope(send(*cli, encode(*cli, std::move(request)), timeout));
+      // The batch as a whole may have been rejected.
+      check(response);
+      error::qwrpc_assert(response.kind == envelope::Kind::batch && response.batch.size() == batch.requests.size(),
+                          error::envelope::invalid_response);
+      batch.responses = std::move(response.batch);
+    }
+    
+    // Calls a streaming method (see RpcServer::register_method). `on_item` gets every Item as it arrives,
+    // on the reader thread of the connection, and the call returns once the stream has ended.
+    // If `on_item` throws, the remaining items are skipped and the exception is rethrown here.
+    template<typename Item, typename F, typename ...Args>
+    void call_stream(const std::string &method_id, F &&on_item, Args &&... args)
+    {
+      std::exception_ptr failed;
+      auto cli = pool.get();
+      auto res = cli->async_send_stream(
+          encode(*cli, make_request<method::Writer<Item>>(std::chrono::milliseconds(0), method_id,
+                                                          std::forward<Args>(args)...)),
+          [&on_item, &failed](std::string &&item)
           {
-              {"id",           method_id},
-              {"expected_ret", std::string(method::qwrpc_type_id<Ret>())},
-              {"args",         internal_args}
-          };
-      auto res = cli.send_and_recv(utils::to_str(params));
-      error::qwrpc_assert(!res.empty());
+            if (failed) return;
+            try
+            {
+              on_item(serializer::deserialize<Item>(item));
+            }
+            catch (...)
+            {
+              failed = std::current_exception();
+            }
+          });
+      parse_response<void>(res.get());
+      if (failed) std::rethrow_exception(failed);
+    }
+    
+    // Calls a client-streaming method (see RpcServer::register_method). `args` are the arguments after
+    // the Reader, the items follow through write() on the returned Upload and finish() gets the result.
+    // The server grants credit as its handler reads, so a fast writer blocks instead of piling up data.
+    // Each item can be at most connector::MAX_STREAM_ITEM bytes serialized, see Upload::write().
+    template<typename Ret, typename Item, typename ...Args>
+    Upload<Ret, Item> open_stream(const std::string &method_id, Args &&... args)
+    {
+      auto request = make_request<Ret>(std::chrono::milliseconds(0), method_id, std::forward<Args>(args)...);
+      // The Reader's slot, see method::Method.
+      request.args.emplace(request.args.begin(), std::string(), method::qwrpc_type<method::Reader<Item>>());
+      auto promise = std::make_shared<std::promise<std::string>>();
+      auto ret = promise->get_future();
+      auto cli = pool.get();
+      auto id = cli->start_upload(encode(*cli, std::move(request)),
+                                  [promise](std::string &&res, std::exception_ptr err)
+                                  {
+                                    if (err)
+                                    {
+                                      promise->set_exception(err);
+                                    }
+                                    else
+                                    {
+                                      promise->set_value(std::move(res));
+                                    }
+                                  });
+      return {std::move(cli), id, std::move(ret)};
+    }
+  
+  private:
+    using Clock = std::chrono::steady_clock;
+    
+    // Waits for at most `timeout`, if it isn't 0.
+    static std::string send(connector::Client &cli, const std::string &request, std::chrono::milliseconds timeout)
+    {
+      if (timeout.count() == 0) return cli.send_and_recv(request);
+      auto deadline = Clock::now() + timeout;
+      uint64_t id;
+      auto res = cli.async_send(request, id);
+      return cli.wait_until(res, id, deadline);
+    }
+    
+    // The envelope carries milliseconds in a uint32_t, and its text form in an int. Longer ones are cut to what
+    // both hold, which is still over 24 days.
+    static uint32_t wire_timeout(std::chrono::milliseconds timeout)
+    {
+      if (timeout.count() <= 0) return 0;
+      return static_cast<uint32_t>(std::min<std::chrono::milliseconds::rep>(timeout.count(),
+                                                                            std::numeric_limits<int32_t>::max()));
+    }
+    
+    // `timeout` tells the server how long the caller waits, 0 if it has no deadline.
+    template<typename Ret, typename ...Args>
+    static envelope::Request make_request(std::chrono::milliseconds timeout, const std::string &method_id,
+                                          Args &&... args)
+    {
+      envelope::Request request;
+      request.timeout = wire_timeout(timeout);
+      request.id = method_id;
+      request.expected_ret = method::qwrpc_type<Ret>();
+      request.args = method::args_to_param(std::forward<Args>(args)...);
+      return request;
+    }
+    
+    // The method table the server of `cli` sent with its hello, decoded once per connection.
+    struct MethodTable
+    {
+      std::vector<envelope::MethodInfo> methods;
+      std::unordered_map<std::string, uint32_t> ids;
+    };
+    
+    // Null until the table has arrived, or if the server sent none.
+    static std::shared_ptr<const MethodTable> method_table(connector::Client &cli)
+    {
+      if (auto table = cli.get_decoded_table<MethodTable>()) return table;
+      auto data = cli.get_method_table();
+      if (data == nullptr) return nullptr;
+      auto table = std::make_shared<MethodTable>();
+      try
+      {
+        table->methods = envelope::decode_table(*data);
+      }
+      catch (error::Error &err)
+      {
+        // Calls just go by name then.
+        logger::warn(logger::no_fmt, "Invalid method table: ", err.get_detail());
+        table->methods.clear();
+      }
+      for (uint32_t i = 0; i < table->methods.size(); ++i)
+      {
+        table->ids.emplace(table->methods[i].name, i);
+      }
+      cli.set_decoded_table(table);
+      return table;
+    }
+    
+    // Lets a call go by the index of its method if the method table lists it. Returns false with what the
+    // server would have answered in `failure` if the call doesn't match the method.
+    static bool use_index(connector::Client &cli, envelope::Request &request, envelope::Response &failure)
+    {
+      auto table = method_table(cli);
+      if (table == nullptr) return true;
+      auto it = table->ids.find(request.id);
+      // Maybe registered after the server started.
+      if (it == table->ids.end()) return true;
+      auto &info = table->methods[it->second];
+      if (request.args.size() == info.args.size()
+          && method::signature_of(request.expected_ret, request.args) == info.signature)
+      {
+        request.index = it->second;
+        return true;
+      }
+      bool args_match = request.args.size() == info.args.size();
+      for (std::size_t i = 0; args_match && i < info.args.size(); ++i)
+      {
+        args_match = request.args[i].get_type().hash == info.args[i];
+      }
+      if (!args_match)
+      {
+        failure = envelope::failure(error::rpc_server::invalid_argument, envelope::Detail::expected_args,
+                                    info.arg_names);
+      }
+      else
+      {
+        failure = envelope::failure(error::rpc_server::invalid_expected_ret, envelope::Detail::expected_ret,
+                                    {info.ret_name});
+      }
+      return false;
+    }
+    
+    // In the binary envelope if the server of `cli` agreed to it, as czh otherwise.
+    // With the server's method table, calls go by the index of their method, and those that don't match it
+    // throw here, like call() would after asking the server. Unless `reject` is false, then they go by name.
+    static std::string encode(connector::Client &cli, envelope::Request &&request, bool reject = true)
+    {
+      if (!cli.binary_envelope()) return envelope::to_czh(request);
+      envelope::Response failure;
+      if (request.kind == envelope::Kind::call && !use_index(cli, request, failure) && reject)
+      {
+        check(failure);
+      }
+      return envelope::encode(request);
+    }
+    
+    // Either form, the server answers in the form of the request, and with czh if it rejects it early.
+    static envelope::Response parse_envelope(const std::string &res)
+    {
+      error::qwrpc_assert(!res.empty(), error::envelope::invalid_response);
+      if (envelope::is_binary(res)) return envelope::decode_response(res);
       czh::Node node;
       try
       {
@@ -63,61 +441,42 @@ namespace qwrpc::rpc_client
       {
         qwrpc::error::qwrpc_unreachable("Invalid return czh(libczh internal):" + err.get_content());
       }
-      
-      error::qwrpc_assert(node.has_node("status") && node["status"].is<std::string>());
-      if (node["status"].get<std::string>() != "success")
+      return envelope::response_from_czh(node);
+    }
+    
+    // Throws what the server said if the call failed.
+    static void check(const envelope::Response &response)
+    {
+      if (response.status == envelope::Status::success) return;
+      auto err = response.message;
+      if (response.detail == envelope::Detail::expected_args)
       {
-        error::qwrpc_assert(node.has_node("message") && node["message"].is<std::string>());
-        auto err = node["message"].get<std::string>();
-        if (err == error::rpc_server::invalid_argument)
-        {
-          if (node.has_node("czh_error") && node["czh_error"].is<std::string>())
-          {
-            throw error::Error(err + "[" + node["czh_error"].get<std::string>() + "]");
-          }
-          else if (node.has_node("expected_args") && node["expected_args"].is<czh::value::Array>())
-          {
-            error::qwrpc_assert(node["expected_args"].get_value().template can_get<std::vector<std::string>>());
-            auto expected = node["expected_args"].get<std::vector<std::string>>();
-            err += "[expected: ";
-            for (auto &r: expected)
-            {
-              err += r + ", ";
-            }
-            if (!expected.empty())
-            {
-              err.pop_back();
-              err.pop_back();
-            }
-            err += "]";
-            throw error::Error(err);
-          }
-        }
-        else if (node.has_node("expected_ret") && node["expected_ret"].is<std::string>())
-        {
-          err += "[" + node["expected_ret"].get<std::string>() + "]";
-          throw error::Error(err);
-        }
-        else if (err == error::rpc_server::invoke_error)
+        err += "[expected: ";
+        for (auto &r: response.details)
         {
-          error::qwrpc_assert(node.has_node("czh_error") && node["qwrpc_error"].is<std::string>());
-          throw error::Error(err + "[" + node["qwrpc_error"].get<std::string>() + "]");
+          err += r + ", ";
         }
-        else
+        if (!response.details.empty())
         {
-          throw error::Error(err);
+          err.pop_back();
+          err.pop_back();
         }
+        err += "]";
+      }
+      else if (response.detail != envelope::Detail::none && !response.details.empty())
+      {
+        err += "[" + response.details[0] + "]";
       }
-      error::qwrpc_assert(node.has_node("return") && node["return"].is<czh::value::Array>());
-      auto ret = node["return"].get<czh::value::Array>();
-      return method::ret_get<Ret>(ret);
+      throw error::Error(err);
     }
     
-    template<typename ...Rets, typename ...Args>
-    auto async_call(const std::string &method_id, Args &&... args)
+    template<typename Ret>
+    static Ret parse_response(const std::string &res)
     {
-      return std::async([this](auto &&id, auto &&... args) { return call<Rets...>(id, args...); },
-                        method_id, args...);
+      auto response = parse_envelope(res);
+      check(response);
+      error::qwrpc_assert(response.kind == envelope::Kind::call, error::envelope::invalid_response);
+      return method::ret_get<Ret>(response.ret);
     }
   };
 }
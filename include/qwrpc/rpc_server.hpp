@@ -19,10 +19,15 @@
 #include "error.hpp"
 #include "utils.hpp"
 #include "method.hpp"
+#include "envelope.hpp"
 #include "libczh/czh.hpp"
 #include "connector.hpp"
 #include <string>
 #include <map>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <memory>
 #include <functional>
 #include <sstream>
 #include <tuple>
@@ -30,11 +35,18 @@
 namespace qwrpc::error::rpc_server
 {
   constexpr auto invalid_request = "Request needs to be a valid czh.";
+  constexpr auto invalid_envelope = "Request needs to be a valid binary envelope.";
   constexpr auto invalid_argument = "Invalid arguments.";
   constexpr auto invalid_expected_ret = "Invalid expected_ret.";
   constexpr auto invalid_method_id = "Invalid method id.";
   constexpr auto unknown_id = "Unknown method id.";
   constexpr auto invoke_error = "Invoke failed.";
+  constexpr auto overloaded = "Server overloaded.";
+  constexpr auto invalid_batch = "Batch needs to be an array of requests.";
+  constexpr auto not_batchable = "Streaming methods can not be called in a batch.";
+  constexpr auto deadline_exceeded = "Deadline exceeded.";
+  constexpr auto cancelled = "Call cancelled.";
+  constexpr auto already_started = "Methods can not be registered after start().";
 }
 
 namespace qwrpc::rpc_server
@@ -42,133 +54,414 @@ namespace qwrpc::rpc_server
   class RpcServer
   {
   private:
-    std::map<std::string, method::Method> methods;
-    int port;
+    // Indexed by the ids of the method table, see start().
+    std::vector<std::pair<std::string, method::Method>> methods;
+    std::map<std::string, uint32_t> ids;
+    // Workers read the methods without a lock, so they are fixed once this is set.
+    std::atomic<bool> started;
+    connector::Server svr;
+    // Declared after svr, so that no future completes a call once the connector is gone.
+    method::FutureWaiter waiter;
   public:
-    RpcServer(int port_) : port(port_) {}
+    // connector::Addr::unix_socket(path) listens on a Unix domain socket.
+    RpcServer(const connector::Addr &addr_, const connector::ServerConfig &config_ = {})
+        : started(false), svr(addr_, [this](const connector::Req &request, connector::Res &res) { route(request, res); }, config_)
+    {
+      svr.set_overloaded_response(utils::to_str({{"status",  "overloaded"},
+                                                 {"message", error::rpc_server::overloaded}}));
+      svr.set_failed_response(envelope::to_czh(envelope::failure(error::rpc_server::invoke_error)));
+    }
+    
+    RpcServer(int port_, const connector::ServerConfig &config_ = {})
+        : RpcServer(connector::Addr{port_}, config_) {}
     
+    // A method whose first parameter is a method::Writer<T> & streams: the items it writes go out
+    // one frame each while it runs, callers use RpcClient::call_stream<T>.
+    // One whose first parameter is a method::Reader<T> & reads items the caller sends while it runs,
+    // callers use RpcClient::open_stream<Ret, T>.
+    // One whose first parameter is a const method::CancelToken & can stop early once the caller has cancelled
+    // the call or its deadline has passed. Writer and Reader tell that too.
+    // One returning a qwrpc::coro::Task<T> or a std::future<T> is asynchronous: the worker is released when
+    // it returns, and the response goes out once the task or the future is done. Callers see a method
+    // returning T.
+    // Registering a name again replaces its method. Throws once start() has been called.
     template<typename F>
     RpcServer &register_method(const std::string &name, F &&m)
     {
-      methods[name] = method::Method(std::function(std::forward<F>(m)));
+      error::qwrpc_assert(!started.load(std::memory_order_acquire), error::rpc_server::already_started);
+      auto [it, inserted] = ids.try_emplace(name, static_cast<uint32_t>(methods.size()));
+      if (inserted)
+      {
+        methods.emplace_back(name, method::Method(std::function(std::forward<F>(m))));
+      }
+      else
+      {
+        methods[it->second].second = method::Method(std::function(std::forward<F>(m)));
+      }
       logger::info(logger::no_fmt, "Method Register: ", name);
       return *this;
     }
     
+    // Clients get the method table with their hello, and then call the methods by their index in it.
     RpcServer &start()
     {
-      connector::Server svr(port, [this](const connector::Req &request, connector::Res &res)
+      started.store(true, std::memory_order_release);
+      svr.set_method_table(envelope::encode(method_table()));
+      svr.start();
+      return *this;
+    }
+    
+    // How often the limits of connector::ServerConfig rejected something.
+    connector::ServerStats get_stats() const { return svr.get_stats(); }
+  
+  private:
+    void route(const connector::Req &request, connector::Res &res)
+    {
+      auto &content = request.get_content();
+      // Responses go out in the form the request came in.
+      bool binary = envelope::is_binary(content);
+      if (!binary)
       {
-        logger::info(logger::no_fmt,
-                     "Received request from: ", request.get_ip(), ", request: ", request.get_content());
-        czh::Node req;
-        try
+        logger::info(logger::no_fmt, "Received request from: ", request.get_ip(), ", request: ", content);
+      }
+      envelope::Request req;
+      envelope::Response failure;
+      if (!parse_request(content, req, failure))
+      {
+        respond(res, failure, binary, request.get_ip());
+        return;
+      }
+      if (binary)
+      {
+        logger::info(logger::no_fmt, "Received request from: ", request.get_ip(), ", method: ",
+                     req.kind == envelope::Kind::batch ? "(batch)"
+                     : req.index == envelope::BY_NAME ? req.id : "#" + std::to_string(req.index));
+      }
+      // A call whose caller has given up already is answered without running it.
+      std::optional<connector::Req::Clock::time_point> deadline;
+      if (req.timeout != 0)
+      {
+        deadline = request.get_received() + std::chrono::milliseconds(req.timeout);
+      }
+      auto expired = [&request, deadline]
+      {
+        return request.is_cancelled() || (deadline && connector::Req::Clock::now() >= *deadline);
+      };
+      if (expired())
+      {
+        respond(res, envelope::failure(request.is_cancelled() ? error::rpc_server::cancelled
+                                                               : error::rpc_server::deadline_exceeded),
+                binary, request.get_ip());
+        return;
+      }
+      if (req.kind == envelope::Kind::batch)
+      {
+        route_batch(request, res, req, binary, expired);
+        return;
+      }
+      auto method = find_method(req, failure);
+      if (method == nullptr)
+      {
+        respond(res, failure, binary, request.get_ip());
+        return;
+      }
+      if (method->is_async())
+      {
+        auto done = res.defer();
+        method->call_async(std::move(req.args),
+                           [done, binary, ip = request.get_ip()](method::MethodParam &&ret, std::exception_ptr err)
+                           {
+                             done(format(response_of(std::move(ret), err), binary, ip));
+                           }, waiter);
+        return;
+      }
+      method::Streams streams{
+          [&res](method::Data &&item) { res.write(item.get_data()); },
+          [&request](std::string &item) { return request.read(item); },
+          expired};
+      respond(res, invoke(*method, std::move(req.args), streams), binary, request.get_ip());
+    }
+    
+    // Answers the calls of a batch in one response, each with its own status. They run one after another
+    // on this worker, except asynchronous ones, which all run at the same time.
+    void route_batch(const connector::Req &request, connector::Res &res, const envelope::Request &req, bool binary,
+                     const std::function<bool()> &expired)
+    {
+      struct Batch
+      {
+        std::vector<std::string> results;
+        std::atomic<std::size_t> remaining;
+        connector::Res::Done done;
+        bool binary;
+        
+        // The last one to finish gets the response.
+        bool arrive() { return remaining.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+        
+        std::string response()
+        {
+          envelope::Response ret;
+          ret.kind = envelope::Kind::batch;
+          ret.batch = std::move(results);
+          return binary ? envelope::encode(ret) : envelope::to_czh(ret);
+        }
+      };
+      auto &calls = req.batch;
+      auto batch = std::make_shared<Batch>();
+      batch->binary = binary;
+      batch->results.resize(calls.size());
+      std::vector<std::pair<const method::Method *, envelope::Request>> found(calls.size());
+      std::size_t async = 0;
+      for (std::size_t i = 0; i < calls.size(); ++i)
+      {
+        envelope::Response failure;
+        if (parse_request(calls[i], found[i].second, failure))
         {
-          czh::Czh parser(request.get_content(), czh::InputMode::string);
-          req = parser.parse();
+          found[i].first = find_method(found[i].second, failure);
         }
-        catch (czh::error::CzhError &err)
+        // Streaming methods can't be batched, their items would have nowhere to go. They don't run at all.
+        if (found[i].first != nullptr && found[i].first->get_stream_kind() != method::StreamKind::none)
         {
-          res.set_content(utils::to_str({{"status",    "failed"},
-                                         {"message",   error::rpc_server::invalid_request},
-                                         {"czh_error", err.get_content()}}));
-          logger::warn(logger::no_fmt,
-                       "Respond to: ", request.get_ip(),
-                       ", response: ", res.get_content());
-          return;
+          found[i].first = nullptr;
+          failure = envelope::failure(error::rpc_server::not_batchable);
         }
-        catch (czh::error::Error &err)
+        if (found[i].first == nullptr)
         {
-          res.set_content(utils::to_str({{"status",    "failed"},
-                                         {"message",   error::rpc_server::invalid_request},
-                                         {"czh_error", err.get_content()}}));
-          logger::warn(logger::no_fmt,
-                       "Respond to: ", request.get_ip(),
-                       ", response: ", res.get_content());
-          return;
+          batch->results[i] = format(failure, envelope::is_binary(calls[i]), request.get_ip());
         }
-        if (!req.has_node("id") && req["id"].is<std::string>())
+        else if (found[i].first->is_async())
         {
-          res.set_content(utils::to_str({{"status",  "failed"},
-                                         {"message", error::rpc_server::invalid_method_id}}));
-          logger::warn(logger::no_fmt,
-                       "Respond to: ", request.get_ip(),
-                       ", response: ", res.get_content());
-          return;
+          ++async;
         }
-        if (!req.has_node("args") && req["expected_ret"].is<std::string>())
+      }
+      // One more for this worker, so that the response can't go out while calls are still being started.
+      batch->remaining.store(async + 1, std::memory_order_relaxed);
+      if (async != 0) batch->done = res.defer();
+      // Only carries the deadline, streaming methods have been answered above.
+      method::Streams no_streams{
+          [](method::Data &&) { error::qwrpc_unreachable(error::rpc_server::not_batchable); },
+          [](std::string &) -> bool
+          {
+            error::qwrpc_unreachable(error::rpc_server::not_batchable);
+            return false;
+          },
+          expired};
+      for (std::size_t i = 0; i < calls.size(); ++i)
+      {
+        auto method = found[i].first;
+        if (method == nullptr) continue;
+        bool item_binary = envelope::is_binary(calls[i]);
+        auto &args = found[i].second.args;
+        if (method->is_async())
         {
-          res.set_content(utils::to_str({{"status",  "failed"},
-                                         {"message", error::rpc_server::invalid_expected_ret}}));
-          logger::warn(logger::no_fmt,
-                       "Respond to: ", request.get_ip(),
-                       ", response: ", res.get_content());
-          return;
+          method->call_async(std::move(args),
+                             [batch, i, item_binary, ip = request.get_ip()]
+                                 (method::MethodParam &&ret, std::exception_ptr err)
+                             {
+                               batch->results[i] = format(response_of(std::move(ret), err), item_binary, ip);
+                               if (batch->arrive()) batch->done(batch->response());
+                             }, waiter);
         }
-        if (!req.has_node("args") && req["args"].is<czh::value::Array>())
+        else
         {
-          res.set_content(utils::to_str({{"status",  "failed"},
-                                         {"message", error::rpc_server::invalid_argument}}));
-          logger::warn(logger::no_fmt,
-                       "Respond to: ", request.get_ip(),
-                       ", response: ", res.get_content());
-          return;
+          batch->results[i] = format(invoke(*method, std::move(args), no_streams), item_binary, request.get_ip());
         }
-        auto id = req["id"].get<std::string>();
-        auto args = req["args"].get<czh::value::Array>();
-        auto method = methods.find(id);
-        if (method == methods.end())
+      }
+      if (!batch->arrive()) return;
+      if (async != 0)
+      {
+        batch->done(batch->response());
+      }
+      else
+      {
+        res.set_content(batch->response());
+      }
+    }
+    
+    // Reads a request in either form, or returns false with the response in `failure`.
+    static bool parse_request(const std::string &content, envelope::Request &req, envelope::Response &failure)
+    {
+      if (envelope::is_binary(content))
+      {
+        try
         {
-          res.set_content(utils::to_str({{"status",  "failed"},
-                                         {"message", error::rpc_server::unknown_id}}));
-          logger::warn(logger::no_fmt,
-                       "Respond to: ", request.get_ip(),
-                       ", response: ", res.get_content());
-          return;
+          req = envelope::decode_request(content);
         }
-        if (!method->second.check_args(args))
+        catch (error::Error &err)
         {
-          res.set_content(utils::to_str({{"status",        "failed"},
-                                         {"message",       error::rpc_server::invalid_argument},
-                                         {"expected_args", method->second.expected_args()}}));
-          logger::warn(logger::no_fmt,
-                       "Respond to: ", request.get_ip(),
-                       ", response: ", res.get_content());
-          return;
+          failure = envelope::failure(error::rpc_server::invalid_envelope, envelope::Detail::request_error,
+                                      {err.get_detail()});
+          return false;
         }
-        if (!method->second.check_ret(req["expected_ret"].get<std::string>()))
+        return true;
+      }
+      czh::Node node;
+      try
+      {
+        czh::Czh parser(content, czh::InputMode::string);
+        node = parser.parse();
+      }
+      catch (czh::error::CzhError &err)
+      {
+        failure = envelope::failure(error::rpc_server::invalid_request, envelope::Detail::request_error,
+                                    {err.get_content()});
+        return false;
+      }
+      catch (czh::error::Error &err)
+      {
+        failure = envelope::failure(error::rpc_server::invalid_request, envelope::Detail::request_error,
+                                    {err.get_content()});
+        return false;
+      }
+      if (node.has_node("timeout") && node["timeout"].is<int>() && node["timeout"].get<int>() > 0)
+      {
+        req.timeout = static_cast<uint32_t>(node["timeout"].get<int>());
+      }
+      if (node.has_node("batch"))
+      {
+        if (!node["batch"].is<czh::value::Array>()
+            || !node["batch"].get_value().template can_get<std::vector<std::string>>())
         {
-          res.set_content(utils::to_str({{"status",       "failed"},
-                                         {"message",      error::rpc_server::invalid_expected_ret},
-                                         {"expected_ret", method->second.expected_ret()}}));
-          logger::warn(logger::no_fmt,
-                       "Respond to: ", request.get_ip(),
-                       ", response: ", res.get_content());
-          return;
+          failure = envelope::failure(error::rpc_server::invalid_batch);
+          return false;
         }
-        method::MethodParam ret;
+        req.kind = envelope::Kind::batch;
+        req.batch = node["batch"].get<std::vector<std::string>>();
+        return true;
+      }
+      if (!node.has_node("id") || !node["id"].is<std::string>())
+      {
+        failure = envelope::failure(error::rpc_server::invalid_method_id);
+        return false;
+      }
+      if (!node.has_node("expected_ret") || !node["expected_ret"].is<std::string>())
+      {
+        failure = envelope::failure(error::rpc_server::invalid_expected_ret);
+        return false;
+      }
+      if (!node.has_node("args") || !node["args"].is<czh::value::Array>()
+          || !method::czh_to_param(node["args"].get<czh::value::Array>(), req.args))
+      {
+        failure = envelope::failure(error::rpc_server::invalid_argument);
+        return false;
+      }
+      req.id = node["id"].get<std::string>();
+      req.expected_ret.hash = method::type_hash(node["expected_ret"].get<std::string>());
+      return true;
+    }
+    
+    // The method a call asks for, or nullptr with the response in `failure` if it can't be called.
+    const method::Method *find_method(const envelope::Request &req, envelope::Response &failure) const
+    {
+      if (req.kind == envelope::Kind::batch)
+      {
+        // Batches don't nest.
+        failure = envelope::failure(error::rpc_server::invalid_method_id);
+        return nullptr;
+      }
+      auto index = req.index;
+      if (index == envelope::BY_NAME)
+      {
+        auto it = ids.find(req.id);
+        index = it == ids.end() ? envelope::BY_NAME : it->second;
+      }
+      if (index >= methods.size())
+      {
+        failure = envelope::failure(error::rpc_server::unknown_id);
+        return nullptr;
+      }
+      auto &method = methods[index].second;
+      if (method.check(req.expected_ret, req.args)) return &method;
+      if (!method.check_args(req.args))
+      {
+        failure = envelope::failure(error::rpc_server::invalid_argument, envelope::Detail::expected_args,
+                                    method.expected_args());
+      }
+      else
+      {
+        failure = envelope::failure(error::rpc_server::invalid_expected_ret, envelope::Detail::expected_ret,
+                                    {method.expected_ret()});
+      }
+      return nullptr;
+    }
+    
+    std::vector<envelope::MethodInfo> method_table() const
+    {
+      std::vector<envelope::MethodInfo> table;
+      for (auto &[name, method]: methods)
+      {
+        envelope::MethodInfo info;
+        info.name = name;
+        info.signature = method.get_signature();
+        info.ret = method.get_ret().hash;
+        info.ret_name = method.expected_ret();
+        for (auto &r: method.get_args()) info.args.emplace_back(r.hash);
+        info.arg_names = method.expected_args();
+        table.emplace_back(std::move(info));
+      }
+      return table;
+    }
+    
+    static envelope::Response invoke(const method::Method &method, method::MethodParam &&args,
+                                     const method::Streams &streams)
+    {
+      method::MethodParam ret;
+      try
+      {
+        ret = method.call(std::move(args), streams);
+      }
+      catch (...)
+      {
+        // Whatever the method throws, so that the call still gets its answer.
+        return response_of({}, std::current_exception());
+      }
+      return response_of(std::move(ret), nullptr);
+    }
+    
+    static envelope::Response response_of(method::MethodParam &&ret, std::exception_ptr err)
+    {
+      if (err)
+      {
+        std::string detail;
         try
         {
-          ret = std::move(method->second.call(args));
+          std::rethrow_exception(err);
         }
-        catch (error::Error &err)
+        catch (error::Error &e)
         {
-          res.set_content(utils::to_str({{"status",      "failed"},
-                                         {"message",     error::rpc_server::invoke_error},
-                                         {"qwrpc_error", err.get_content()}}));
-          logger::warn(logger::no_fmt,
-                       "Respond to: ", request.get_ip(),
-                       ", response: ", res.get_content());
-          return;
+          detail = e.get_content();
         }
-        res.set_content(utils::to_str({{"status", "success"},
-                                       {"return", method::ret_to_czh_type(ret)}}));
-        logger::info(logger::no_fmt,
-                     "Respond to: ", request.get_ip(),
-                     ", response: ", res.get_content());
-      });
-      svr.start();
-      return *this;
+        catch (std::exception &e)
+        {
+          detail = e.what();
+        }
+        catch (...)
+        {
+          detail = "unknown exception";
+        }
+        return envelope::failure(error::rpc_server::invoke_error, envelope::Detail::invoke_error, {detail});
+      }
+      envelope::Response res;
+      res.ret = std::move(ret);
+      return res;
+    }
+    
+    static std::string format(const envelope::Response &response, bool binary, const std::string &ip)
+    {
+      auto content = binary ? envelope::encode(response) : envelope::to_czh(response);
+      if (response.status == envelope::Status::failed)
+      {
+        logger::warn(logger::no_fmt, "Respond to: ", ip, ", response: ", binary ? response.message : content);
+      }
+      else
+      {
+        logger::info(logger::no_fmt, "Respond to: ", ip, ", response: ", binary ? "(binary)" : content);
+      }
+      return content;
+    }
+    
+    static void respond(connector::Res &res, const envelope::Response &response, bool binary, const std::string &ip)
+    {
+      res.set_content(format(response, binary, ip));
     }
   };
 }
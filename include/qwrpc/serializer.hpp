@@ -15,12 +15,24 @@
 #define QWRPC_SERIALIZER_HPP
 #pragma once
 
+#include "error.hpp"
 #include "utils.hpp"
 #include "libczh/czh.hpp"
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <ranges>
+#include <span>
 #include <type_traits>
 #include <vector>
 #include <string>
 
+namespace qwrpc::error::serializer
+{
+  constexpr auto truncated = "Truncated serialized container.";
+  constexpr auto trailing = "Unexpected data after serialized container.";
+  constexpr auto too_large = "Container or element too large to serialize.";
+}
 namespace qwrpc::serializer
 {
   template<typename T>
@@ -29,6 +41,18 @@ namespace qwrpc::serializer
   template<typename T>
   std::string serialize(const T &item);
   
+  // Elements of containers that are written as their raw bytes, and copied in one block if the container is
+  // contiguous. Other elements go through serialize()/deserialize(), so that their specializations apply.
+  // Specialize it as true for a trivially copyable type without such specializations to get the fast path.
+  template<typename T>
+  struct is_bitwise_serializable : public std::bool_constant<std::is_arithmetic_v<T> || std::is_enum_v<T>> {};
+  
+  template<typename T, std::size_t N>
+  struct is_bitwise_serializable<std::array<T, N>> : public is_bitwise_serializable<std::remove_cv_t<T>> {};
+  
+  template<typename T>
+  constexpr bool is_bitwise_serializable_v = is_bitwise_serializable<std::remove_cv_t<T>>::value;
+  
   namespace details
   {
     template<typename T>
@@ -78,19 +102,36 @@ namespace qwrpc::serializer
     template<typename T>
     constexpr bool is_serializable_v = is_serializable<T>::value;
     
+    template<typename T>
+    struct is_span : public std::false_type {};
+    template<typename T, std::size_t Extent>
+    struct is_span<std::span<T, Extent>> : public std::true_type {};
+    
+    template<typename T>
+    constexpr bool is_span_v = is_span<T>::value;
+    
+    // Ranges whose elements are one block of plain bytes, and so are copied in one go.
+    template<typename T>
+    concept BitwiseRange =
+    std::ranges::contiguous_range<T> && std::ranges::sized_range<T>
+    && is_bitwise_serializable_v<std::ranges::range_value_t<T>>;
+    
     template<typename T>
     concept Serializable = is_serializable_v<T>;
     struct NotImplemented {};
     struct TriviallyCopyable {};
     struct Container {};
     struct StdString {};
+    struct Span {};
     template<Serializable T>
     struct TagDispatch
     {
-      using tag = std::conditional_t<std::is_trivially_copyable_v<std::decay_t<T>>, TriviallyCopyable,
+      // A std::span is trivially copyable itself, but what it views is what is meant.
+      using tag = std::conditional_t<is_span_v<std::decay_t<T>>, Span,
+          std::conditional_t<std::is_trivially_copyable_v<std::decay_t<T>>, TriviallyCopyable,
           std::conditional_t<std::is_same_v<std::decay_t<T>, std::string>, StdString,
               std::conditional_t<is_serializable_container_v<std::decay_t<T>>, Container,
-                  NotImplemented>>>;
+                  NotImplemented>>>>;
     };
     
     template<typename T>
@@ -102,11 +143,7 @@ namespace qwrpc::serializer
     template<typename T>
     std::string internal_serialize(TriviallyCopyable, const T &item)
     {
-      std::vector<char> ret(sizeof(T));
-      std::memcpy(ret.data(), &item, sizeof(T));
-      std::string str;
-      for (auto &r: ret) { str += r; }
-      return str;
+      return {reinterpret_cast<const char *>(&item), sizeof(T)};
     }
     
     template<typename T>
@@ -130,6 +167,8 @@ namespace qwrpc::serializer
       return str;
     }
     
+#ifdef QWRPC_CZH_CONTAINERS
+    // The czh container format of older versions, for talking to peers that still use it.
     template<typename T>
     std::string internal_serialize(Container, const T &item)
     {
@@ -160,6 +199,167 @@ namespace qwrpc::serializer
       }
       return ret;
     }
+#else
+    // A container is its element count (uint32_t), then its elements one after another. Bitwise serializable
+    // elements take sizeof bytes, strings and everything else serialize() writes are prefixed with their length
+    // (uint32_t), and nested containers are written in place the same way, so it is built in one pass.
+    inline void put_size(std::string &out, std::size_t n)
+    {
+      error::qwrpc_assert(n <= UINT32_MAX, error::serializer::too_large);
+      auto v = static_cast<uint32_t>(n);
+      out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    }
+    
+    inline std::size_t get_size(const char *&pos, const char *end)
+    {
+      uint32_t v;
+      error::qwrpc_assert(end - pos >= static_cast<std::ptrdiff_t>(sizeof(v)), error::serializer::truncated);
+      std::memcpy(&v, pos, sizeof(v));
+      pos += sizeof(v);
+      return v;
+    }
+    
+    template<typename T>
+    void append(std::string &out, const T &item)
+    {
+      if constexpr (is_bitwise_serializable_v<T>)
+      {
+        out.append(reinterpret_cast<const char *>(&item), sizeof(T));
+      }
+      else if constexpr (std::is_same_v<T, std::string>)
+      {
+        put_size(out, item.size());
+        out.append(item);
+      }
+      // Only containers and spans are read back as a count and their elements.
+      else if constexpr (BitwiseRange<const T> && (is_serializable_container_v<T> || is_span_v<T>))
+      {
+        auto count = std::ranges::size(item);
+        put_size(out, count);
+        out.append(reinterpret_cast<const char *>(std::ranges::data(item)),
+                   count * sizeof(std::ranges::range_value_t<T>));
+      }
+      else if constexpr (is_serializable_container_v<T>)
+      {
+        using value_type = std::remove_cvref_t<decltype(*std::begin(std::declval<T>()))>;
+        // Not every container knows its size, the count is filled in afterwards.
+        auto count_pos = out.size();
+        put_size(out, 0);
+        std::size_t count = 0;
+        for (auto &r: item)
+        {
+          append<value_type>(out, r);
+          ++count;
+        }
+        error::qwrpc_assert(count <= UINT32_MAX, error::serializer::too_large);
+        auto v = static_cast<uint32_t>(count);
+        std::memcpy(out.data() + count_pos, &v, sizeof(v));
+      }
+      else
+      {
+        auto str = serialize<T>(item);
+        put_size(out, str.size());
+        out.append(str);
+      }
+    }
+    
+    template<typename T>
+    T extract(const char *&pos, const char *end)
+    {
+      if constexpr (is_bitwise_serializable_v<T>)
+      {
+        error::qwrpc_assert(end - pos >= static_cast<std::ptrdiff_t>(sizeof(T)), error::serializer::truncated);
+        T item;
+        std::memcpy(&item, pos, sizeof(T));
+        pos += sizeof(T);
+        return item;
+      }
+      else if constexpr (is_serializable_container_v<T> && !std::is_same_v<T, std::string>)
+      {
+        using value_type = std::remove_cvref_t<decltype(*std::begin(std::declval<T>()))>;
+        auto count = get_size(pos, end);
+        // Every element takes some bytes, so a corrupted count fails here instead of allocating for it.
+        constexpr std::size_t min_item_size = is_bitwise_serializable_v<value_type> ? sizeof(value_type)
+                                                                                       : sizeof(uint32_t);
+        error::qwrpc_assert(count <= static_cast<std::size_t>(end - pos) / min_item_size,
+                            error::serializer::truncated);
+        T ret;
+        if constexpr (BitwiseRange<T> && requires { ret.resize(count); })
+        {
+          // Straight into the container's storage.
+          ret.resize(count);
+          std::memcpy(std::ranges::data(ret), pos, count * sizeof(value_type));
+          pos += count * sizeof(value_type);
+          return ret;
+        }
+        if constexpr (requires { ret.reserve(count); }) ret.reserve(count);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+          ret.insert(std::end(ret), extract<value_type>(pos, end));
+        }
+        return ret;
+      }
+      else
+      {
+        auto size = get_size(pos, end);
+        error::qwrpc_assert(static_cast<std::size_t>(end - pos) >= size, error::serializer::truncated);
+        std::string str(pos, size);
+        pos += size;
+        if constexpr (std::is_same_v<T, std::string>)
+        {
+          return str;
+        }
+        else
+        {
+          return deserialize<T>(str);
+        }
+      }
+    }
+    
+    template<typename T>
+    std::string internal_serialize(Container, const T &item)
+    {
+      std::string ret;
+      append<T>(ret, item);
+      return ret;
+    }
+    
+    template<typename T>
+    T internal_deserialize(Container, const std::string &str)
+    {
+      const char *pos = str.data();
+      const char *end = str.data() + str.size();
+      auto ret = extract<T>(pos, end);
+      error::qwrpc_assert(pos == end, error::serializer::trailing);
+      return ret;
+    }
+#endif
+    
+    // Written like the std::vector it views, so it is read back as one.
+    template<typename T>
+    std::string internal_serialize(Span, const T &item)
+    {
+      using value_type = std::remove_cv_t<typename T::element_type>;
+#ifdef QWRPC_CZH_CONTAINERS
+      return internal_serialize(Container{}, std::vector<value_type>(item.begin(), item.end()));
+#else
+      std::string ret;
+      if constexpr (is_bitwise_serializable_v<value_type>)
+      {
+        append(ret, item);
+      }
+      else
+      {
+        put_size(ret, item.size());
+        for (auto &r: item) append<value_type>(ret, r);
+      }
+      return ret;
+#endif
+    }
+    
+    // A span can't own what it views, deserialize into a std::vector instead.
+    template<typename T>
+    T internal_deserialize(Span, const std::string &str) = delete;
   }
   
   template<typename T>
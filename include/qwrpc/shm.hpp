@@ -0,0 +1,319 @@
+//   Copyright 2023 qwrpc - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef QWRPC_SHM_HPP
+#define QWRPC_SHM_HPP
+#pragma once
+
+#ifdef __linux__
+#define QWRPC_HAS_SHM
+
+#include "error.hpp"
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <atomic>
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+namespace qwrpc::error::shm
+{
+  constexpr auto memfd_error = "shm memfd error";
+  constexpr auto mmap_error = "shm mmap error";
+  constexpr auto eventfd_error = "shm eventfd error";
+  constexpr auto handshake_error = "shm handshake error";
+  constexpr auto not_unix_socket = "shm needs the Unix socket of the server";
+  constexpr auto ring_corrupted = "shm ring positions corrupted by the peer";
+}
+namespace qwrpc::shm
+{
+  // Positions only grow, the offset in the ring is position & (capacity - 1).
+  // Kept on separate cache lines, so that producer and consumer don't bounce them.
+  struct RingHeader
+  {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> consumer_waiting;
+    std::atomic<uint32_t> producer_waiting;
+    uint64_t capacity;
+  };
+  
+  static_assert(std::atomic<uint64_t>::is_always_lock_free, "shm rings need lock-free atomics");
+  
+  // A single-producer single-consumer byte ring in shared memory.
+  // The peer can write anything to the header, so the capacity and the position of our own end are kept
+  // here, and a peer position more than `capacity` away from ours throws error::shm::ring_corrupted.
+  class Ring
+  {
+  private:
+    RingHeader *hdr;
+    char *data;
+    uint64_t capacity;
+    // `head` if we read from the ring, `tail` if we write to it. Both start at 0.
+    uint64_t pos;
+  public:
+    Ring() : hdr(nullptr), data(nullptr), capacity(0), pos(0) {}
+    
+    Ring(void *base, uint64_t capacity_) : hdr(static_cast<RingHeader *>(base)),
+                                           data(static_cast<char *>(base) + sizeof(RingHeader)),
+                                           capacity(capacity_), pos(0) {}
+    
+    RingHeader *header() const { return hdr; }
+    
+    std::size_t get_capacity() const { return capacity; }
+    
+    std::size_t readable() const
+    {
+      auto n = hdr->tail.load(std::memory_order_acquire) - pos;
+      error::qwrpc_assert(n <= capacity, error::shm::ring_corrupted);
+      return n;
+    }
+    
+    std::size_t writable() const
+    {
+      auto used = pos - hdr->head.load(std::memory_order_acquire);
+      error::qwrpc_assert(used <= capacity, error::shm::ring_corrupted);
+      return capacity - used;
+    }
+    
+    std::size_t write(const char *src, std::size_t n)
+    {
+      n = std::min(n, writable());
+      auto off = pos & (capacity - 1);
+      auto first = std::min<std::size_t>(n, capacity - off);
+      std::memcpy(data + off, src, first);
+      std::memcpy(data, src + first, n - first);
+      pos += n;
+      hdr->tail.store(pos, std::memory_order_release);
+      return n;
+    }
+    
+    std::size_t read(char *dst, std::size_t n)
+    {
+      n = std::min(n, readable());
+      auto off = pos & (capacity - 1);
+      auto first = std::min<std::size_t>(n, capacity - off);
+      std::memcpy(dst, data + off, first);
+      std::memcpy(dst + first, data, n - first);
+      pos += n;
+      hdr->head.store(pos, std::memory_order_release);
+      return n;
+    }
+  };
+  
+  // Spins for a while before sleeping. The spin budget grows when spinning pays off and shrinks when it doesn't.
+  // On a single CPU the other side can't make progress while we spin, so it sleeps right away.
+  class Waiter
+  {
+  private:
+    static constexpr std::size_t min_spin = 64;
+    static constexpr std::size_t max_spin = 1 << 16;
+    std::size_t spin;
+  public:
+    Waiter() : spin(std::thread::hardware_concurrency() > 1 ? 1024 : 0) {}
+    
+    // Waits until ready() or the eventfd `efd` / `other_fd` becomes readable.
+    // `waiting` tells the other side that it needs to signal `efd`.
+    template<typename F>
+    void wait(F &&ready, std::atomic<uint32_t> &waiting, int efd, int other_fd = -1)
+    {
+      for (std::size_t i = 0; i < spin; ++i)
+      {
+        if (ready())
+        {
+          spin = std::min(max_spin, spin * 2);
+          return;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+      }
+      if (spin > min_spin) spin /= 2;
+      waiting.store(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!ready())
+      {
+        pollfd fds[2] = {{efd, POLLIN, 0}, {other_fd, POLLIN, 0}};
+        ::poll(fds, other_fd == -1 ? 1 : 2, -1);
+        drain(efd);
+      }
+      waiting.store(0, std::memory_order_relaxed);
+    }
+    
+    static void drain(int efd)
+    {
+      uint64_t cnt;
+      [[maybe_unused]] auto ret = ::read(efd, &cnt, sizeof(cnt));
+    }
+  };
+  
+  enum Event
+  {
+    // client -> server
+    request_data, response_space,
+    // server -> client
+    response_data, request_space,
+    event_count
+  };
+  
+  // The shared state of one connection: a memfd with the request and the response ring,
+  // and one eventfd for each Event. Created by the client and passed to the server over a Unix socket.
+  class Channel
+  {
+  private:
+    int memfd;
+    void *base;
+    std::size_t size;
+    int efds[event_count];
+    Ring req;
+    Ring res;
+  public:
+    Channel() : memfd(-1), base(MAP_FAILED), size(0), efds{-1, -1, -1, -1} {}
+    
+    Channel(const Channel &) = delete;
+    
+    ~Channel()
+    {
+      if (base != MAP_FAILED) munmap(base, size);
+      if (memfd != -1) ::close(memfd);
+      for (auto &r: efds)
+      {
+        if (r != -1) ::close(r);
+      }
+    }
+    
+    // `capacity` is rounded up to a power of two.
+    static std::unique_ptr<Channel> create(std::size_t capacity)
+    {
+      auto ch = std::make_unique<Channel>();
+      capacity = std::bit_ceil(std::max<std::size_t>(capacity, 4096));
+      ch->memfd = memfd_create("qwrpc-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+      error::qwrpc_assert(ch->memfd != -1, error::shm::memfd_error);
+      ch->size = 2 * (sizeof(RingHeader) + capacity);
+      error::qwrpc_assert(ftruncate(ch->memfd, static_cast<off_t>(ch->size)) == 0, error::shm::memfd_error);
+      // The server checks this, a memfd that could shrink under its mapping would kill it with SIGBUS.
+      error::qwrpc_assert(fcntl(ch->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == 0, error::shm::memfd_error);
+      for (auto &r: ch->efds)
+      {
+        r = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        error::qwrpc_assert(r != -1, error::shm::eventfd_error);
+      }
+      ch->map();
+      for (auto ring: {ch->req.header(), ch->res.header()})
+      {
+        new(ring) RingHeader{};
+        ring->capacity = capacity;
+      }
+      return ch;
+    }
+    
+    void send_to(int sock) const
+    {
+      int fds[event_count + 1] = {memfd, efds[0], efds[1], efds[2], efds[3]};
+      char byte = 0;
+      iovec iov{&byte, 1};
+      alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(fds))] = {};
+      msghdr mh{};
+      mh.msg_iov = &iov;
+      mh.msg_iovlen = 1;
+      mh.msg_control = ctrl;
+      mh.msg_controllen = sizeof(ctrl);
+      auto cmsg = CMSG_FIRSTHDR(&mh);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+      std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+      error::qwrpc_assert(::sendmsg(sock, &mh, MSG_NOSIGNAL) == 1, error::shm::handshake_error);
+    }
+    
+    static std::unique_ptr<Channel> receive_from(int sock)
+    {
+      int fds[event_count + 1];
+      char byte;
+      iovec iov{&byte, 1};
+      alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(fds))] = {};
+      msghdr mh{};
+      mh.msg_iov = &iov;
+      mh.msg_iovlen = 1;
+      mh.msg_control = ctrl;
+      mh.msg_controllen = sizeof(ctrl);
+      error::qwrpc_assert(::recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) == 1, error::shm::handshake_error);
+      auto cmsg = CMSG_FIRSTHDR(&mh);
+      error::qwrpc_assert(cmsg != nullptr && cmsg->cmsg_type == SCM_RIGHTS
+                          && cmsg->cmsg_len == CMSG_LEN(sizeof(fds)), error::shm::handshake_error);
+      std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+      auto ch = std::make_unique<Channel>();
+      ch->memfd = fds[0];
+      std::copy(fds + 1, fds + event_count + 1, ch->efds);
+      // Don't trust the peer: the size must fit two rings, and stay as it is.
+      // fcntl() fails with -1 on an fd that can't be sealed, which has every bit set.
+      struct stat st{};
+      int seals = fcntl(ch->memfd, F_GET_SEALS);
+      error::qwrpc_assert(fstat(ch->memfd, &st) == 0 && st.st_size > 0 && seals != -1
+                          && (seals & F_SEAL_SHRINK) != 0 && (seals & F_SEAL_GROW) != 0, error::shm::handshake_error);
+      ch->size = static_cast<std::size_t>(st.st_size);
+      error::qwrpc_assert(ch->size % 2 == 0 && ch->size / 2 > sizeof(RingHeader)
+                          && std::has_single_bit(ch->size / 2 - sizeof(RingHeader)), error::shm::handshake_error);
+      ch->map();
+      for (auto ring: {ch->req.header(), ch->res.header()})
+      {
+        error::qwrpc_assert(ring->capacity == ch->size / 2 - sizeof(RingHeader), error::shm::handshake_error);
+      }
+      return ch;
+    }
+    
+    Ring &request() { return req; }
+    
+    Ring &response() { return res; }
+    
+    int fd(Event e) const { return efds[e]; }
+    
+    void notify(Event e) const
+    {
+      uint64_t one = 1;
+      [[maybe_unused]] auto ret = ::write(efds[e], &one, sizeof(one));
+    }
+    
+    // Wakes the other side if it went to sleep on `waiting`.
+    void notify_if_waiting(std::atomic<uint32_t> &waiting, Event e) const
+    {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (waiting.load(std::memory_order_relaxed))
+      {
+        waiting.store(0, std::memory_order_relaxed);
+        notify(e);
+      }
+    }
+  
+  private:
+    void map()
+    {
+      base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+      error::qwrpc_assert(base != MAP_FAILED, error::shm::mmap_error);
+      // From the size of our own mapping, never from the headers.
+      auto capacity = size / 2 - sizeof(RingHeader);
+      req = Ring(base, capacity);
+      res = Ring(static_cast<char *>(base) + size / 2, capacity);
+    }
+  };
+}
+#endif
+#endif
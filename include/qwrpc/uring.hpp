@@ -0,0 +1,209 @@
+//   Copyright 2023 qwrpc - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef QWRPC_URING_HPP
+#define QWRPC_URING_HPP
+#pragma once
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define QWRPC_HAS_IO_URING
+
+#include "error.hpp"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+namespace qwrpc::error::uring
+{
+  constexpr auto setup_error = "io_uring setup error";
+  constexpr auto mmap_error = "io_uring mmap error";
+  constexpr auto enter_error = "io_uring enter error";
+  constexpr auto register_error = "io_uring register error";
+}
+namespace qwrpc::uring
+{
+  // A minimal io_uring wrapper on the raw syscalls, so that no liburing is needed.
+  // SQEs are only queued by get_sqe(), nothing reaches the kernel before submit(),
+  // which lets a loop batch all its requests of one iteration into one io_uring_enter().
+  class Uring
+  {
+  private:
+    int fd;
+    io_uring_params params;
+    void *sq_ptr;
+    std::size_t sq_size;
+    void *cq_ptr;
+    std::size_t cq_size;
+    io_uring_sqe *sqes;
+    std::size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    io_uring_cqe *cqes;
+    unsigned queued;
+  public:
+    explicit Uring(unsigned entries)
+        : fd(-1), sq_ptr(MAP_FAILED), sq_size(0), cq_ptr(MAP_FAILED), cq_size(0),
+          sqes(static_cast<io_uring_sqe *>(MAP_FAILED)), sqes_size(0), queued(0)
+    {
+      std::memset(&params, 0, sizeof(params));
+      fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+      error::qwrpc_assert(fd >= 0, error::uring::setup_error);
+      
+      sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      if (params.features & IORING_FEAT_SINGLE_MMAP)
+      {
+        sq_size = cq_size = std::max(sq_size, cq_size);
+      }
+      sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+      if (sq_ptr == MAP_FAILED)
+      {
+        ::close(fd);
+        error::qwrpc_unreachable(error::uring::mmap_error);
+      }
+      if (params.features & IORING_FEAT_SINGLE_MMAP)
+      {
+        cq_ptr = sq_ptr;
+      }
+      else
+      {
+        cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+        {
+          release();
+          error::qwrpc_unreachable(error::uring::mmap_error);
+        }
+      }
+      sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+      sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+      if (sqes == MAP_FAILED)
+      {
+        release();
+        error::qwrpc_unreachable(error::uring::mmap_error);
+      }
+      
+      auto sq = static_cast<char *>(sq_ptr);
+      sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+      sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+      sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+      sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+      auto cq = static_cast<char *>(cq_ptr);
+      cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+      cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+      cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+      cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    }
+    
+    Uring(const Uring &) = delete;
+    
+    ~Uring() { release(); }
+    
+    void register_buffers(const std::vector<iovec> &iovs) const
+    {
+      error::qwrpc_assert(syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+                                  iovs.data(), static_cast<unsigned>(iovs.size())) == 0,
+                          error::uring::register_error);
+    }
+    
+    // Returns a cleared SQE, flushing the queue to the kernel if it is full.
+    io_uring_sqe *get_sqe()
+    {
+      unsigned tail = *sq_tail;
+      while (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= params.sq_entries)
+      {
+        submit(0);
+        tail = *sq_tail;
+      }
+      unsigned index = tail & *sq_mask;
+      io_uring_sqe *sqe = &sqes[index];
+      std::memset(sqe, 0, sizeof(*sqe));
+      sq_array[index] = index;
+      __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+      ++queued;
+      return sqe;
+    }
+    
+    // Submits everything queued since the last call and waits for at least wait_nr completions.
+    void submit(unsigned wait_nr)
+    {
+      while (true)
+      {
+        auto ret = syscall(__NR_io_uring_enter, fd, queued, wait_nr,
+                           wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (ret >= 0)
+        {
+          queued -= std::min<unsigned>(queued, static_cast<unsigned>(ret));
+          return;
+        }
+        if (errno == EINTR) continue;
+        // The CQ ring is full, reap before submitting more.
+        if (errno == EBUSY || errno == EAGAIN) return;
+        error::qwrpc_unreachable(error::uring::enter_error);
+      }
+    }
+    
+    template<typename F>
+    unsigned for_each_cqe(F &&f)
+    {
+      unsigned head = *cq_head;
+      unsigned count = 0;
+      while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+      {
+        const io_uring_cqe cqe = cqes[head & *cq_mask];
+        ++head;
+        ++count;
+        // Release the slot before the handler queues new requests.
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        f(cqe);
+      }
+      return count;
+    }
+    
+    static void prep_rw(io_uring_sqe *sqe, uint8_t op, int fd_, const void *addr, unsigned len,
+                        uint64_t offset, uint64_t user_data)
+    {
+      sqe->opcode = op;
+      sqe->fd = fd_;
+      sqe->addr = reinterpret_cast<uint64_t>(addr);
+      sqe->len = len;
+      sqe->off = offset;
+      sqe->user_data = user_data;
+    }
+  
+  private:
+    void release()
+    {
+      if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+      if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+      if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+      if (fd >= 0) ::close(fd);
+      sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+      cq_ptr = sq_ptr = MAP_FAILED;
+      fd = -1;
+    }
+  };
+}
+#endif
+#endif